@@ -0,0 +1,103 @@
+#ifndef ALSA_H
+#define ALSA_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libs/portaudio.h"
+
+//ALSA specific stream tuning through portaudio's PaAlsa_* extensions.
+//Only built on Linux, and left out with -DMUSIC_LOOP_NO_ALSA for portaudio
+//builds without the ALSA host API, in which case every call here is a no-op.
+#if defined(__linux__) && !defined(MUSIC_LOOP_NO_ALSA)
+#include "libs/pa_linux_alsa.h"
+#define HAVE_ALSA (1)
+#endif
+
+#define ALSA_DEVICE_PREFIX "alsa:"
+
+#ifdef HAVE_ALSA
+typedef PaAlsaStreamInfo AlsaStreamInfo;
+#else
+typedef struct
+{
+    const char *deviceString;
+}
+AlsaStreamInfo;
+#endif
+
+//True if device is opened through ALSA
+inline bool alsaIsDevice(PaDeviceIndex device) {
+#ifdef HAVE_ALSA
+    if(device == paUseHostApiSpecificDeviceSpecification) {
+        return true;
+    }
+    const PaDeviceInfo *info = Pa_GetDeviceInfo(device);
+    return info != NULL && Pa_GetHostApiInfo(info->hostApi)->type == paALSA;
+#else
+    (void) device;
+    return false;
+#endif
+}
+
+//"alsa:<pcm>" names an ALSA pcm directly, such as alsa:hw:1,0 or
+//alsa:plughw:CARD=Device, including ones portaudio does not list. Fills in
+//parameters to open it and returns true if device is one of those.
+inline bool alsaDeviceString(const char *device, PaStreamParameters *parameters, AlsaStreamInfo *info) {
+#ifdef HAVE_ALSA
+    if(strncmp(device, ALSA_DEVICE_PREFIX, strlen(ALSA_DEVICE_PREFIX)) != 0) {
+        return false;
+    }
+    PaAlsa_InitializeStreamInfo(info);
+    info->deviceString = device + strlen(ALSA_DEVICE_PREFIX);
+    parameters->device = paUseHostApiSpecificDeviceSpecification;
+    parameters->hostApiSpecificStreamInfo = info;
+    return true;
+#else
+    (void) device;
+    (void) parameters;
+    (void) info;
+    return false;
+#endif
+}
+
+//Latency a default stream on the ALSA host API would ask for, for devices
+//given as "alsa:" strings, which portaudio has no device info for
+inline PaTime alsaDefaultInputLatency() {
+#ifdef HAVE_ALSA
+    PaHostApiIndex api = Pa_HostApiTypeIdToHostApiIndex(paALSA);
+    if(api >= 0) {
+        const PaDeviceInfo *info = Pa_GetDeviceInfo(Pa_GetHostApiInfo(api)->defaultInputDevice);
+        if(info != NULL) {
+            return info->defaultLowInputLatency;
+        }
+    }
+#endif
+    return 0;
+}
+
+//Periods in the ALSA buffer for the next stream opened, 0 for portaudio's
+//default. More periods ride out longer scheduling stalls at the cost of latency.
+inline PaError alsaSetPeriods(int periods) {
+#ifdef HAVE_ALSA
+    if(periods > 0) {
+        return PaAlsa_SetNumPeriods(periods);
+    }
+#else
+    (void) periods;
+#endif
+    return paNoError;
+}
+
+//Have portaudio run the stream's callback thread SCHED_FIFO. Must be called
+//before the stream starts.
+inline void alsaEnableRealtime(PaStream *stream, bool enable) {
+#ifdef HAVE_ALSA
+    PaAlsa_EnableRealtimeScheduling(stream, enable ? 1 : 0);
+#else
+    (void) stream;
+    (void) enable;
+#endif
+}
+
+#endif
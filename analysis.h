@@ -0,0 +1,158 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "sample.h"
+#include "stft.h"
+#include "fft.h"
+#include "bins.h"
+#include "envelope.h"
+#include "normalise.h"
+#include "noisegate.h"
+#include "idle.h"
+
+//Turn one channel's summed log power into 0-1 LED levels. Returns false,
+//with every bin zero, if nothing cleared the noise gate.
+inline bool shapeSpectrum(double *sum, int bins, double smoothFactor, NoiseGate *gate, BinNormaliser *normaliser,
+                          int channel) {
+    int i;
+
+    //Subtract the background noise; a channel that is all noise needs no more work
+    if(!gate->apply(sum, channel)) {
+        return false;
+    }
+
+    //Remove any invalid values
+    for(i=0; i<bins; i++) {
+        //Case for where sum is zero, log returns -inf
+        if(isinf(sum[i])) {
+          sum[i] = 0.0;
+        }
+    }
+
+    //Scale the results to the range 0-1 against each bin's running floor and ceiling
+    normaliser->apply(sum, channel);
+
+    //Square results so bright is brighter and dim is dimmer
+    for(i=0; i< bins; i++) {
+      sum[i] = sum[i] * sum[i];
+    }
+
+    //Smooth the results
+    for(i=1; i<bins; i++) {
+      sum[i] = smoothFactor * sum[i] + (1 - smoothFactor) * sum[i-1];
+    }
+    return true;
+}
+
+//One source's analysis state: the sliding history, FFT buffers for the shared
+//plan, the bin map, the noise floor, gain and envelope of each bin and the latest spectrum. Only one thread may use it at a time.
+class Analyser
+{
+public:
+    Analyser() : bins(0), channels(0), hop(0), smoothFactor(0), analysed(false), gated(false), dark(false), frames(0),
+        spectrum(NULL), frame(NULL) {
+        binMap.edges = NULL;
+        binMap.rows = NULL;
+        binMap.columns = NULL;
+        binMap.weights = NULL;
+        binMap.power = NULL;
+    }
+    ~Analyser() {
+        binMapFree(&binMap);
+        free(frame);
+        free(spectrum);
+    }
+
+    bool init(FftPlan *plan, int hopSize, WindowType window, int binCount, const FilterbankConfig &layout, double smooth,
+              const NoiseGateConfig &gateConfig, const NormaliserConfig &normaliserConfig,
+              const EnvelopeConfig &envelopeConfig, const IdleConfig &idleConfig, double sampleRate) {
+        channels = plan->channels;
+        idle.init(hopSize / sampleRate, idleConfig);
+        hop = hopSize;
+        bins = binCount;
+        smoothFactor = smooth;
+        frame = (float *) malloc(hop * channels * sizeof(float));
+        spectrum = (double *) calloc(bins * channels, sizeof(double));
+        return frame != NULL && spectrum != NULL
+            && stft.init(plan->size, hop, channels, window)
+            && fft.init(plan)
+            && binMapInitLayout(&binMap, bins, plan->outputs, layout, sampleRate / plan->size)
+            && gate.init(&binMap, bins, channels, hop / sampleRate, gateConfig)
+            && normaliser.init(&binMap, bins, channels, hop / sampleRate, normaliserConfig)
+            && envelope.init(bins * channels, hop / sampleRate, envelopeConfig);
+    }
+
+    //Analyse the whole hops waiting in samples, up to maxHops, leaving the
+    //latest result in spectrum. Hops that arrive while idle only feed the
+    //history and leave spectrum dark. Returns true if anything was consumed.
+    bool consume(SampleRing *samples, size_t maxHops = SIZE_MAX) {
+        bool any = false;
+        for(size_t h=0; h<maxHops && samples->popFloat(frame, hop * channels); h++) {
+            stft.push(frame, hop);
+            frames += hop;
+            any = true;
+            if(idle.update(frame, hop * channels)) {
+                if(!dark) {
+                    memset(spectrum, 0, bins * channels * sizeof(double));
+                    gated = true;
+                    dark = true;
+                }
+                continue;
+            }
+            stft.frame(fft.input);
+            fft.execute();
+            gated = true;
+            for(int c=0; c<channels; c++) {
+                //Downsample to amount of LEDs, taking log10 of the power to stretch
+                //the results to better fit human hearing
+                binMapApply(&binMap, fft.output + c * fft.outputs, spectrum + c * bins);
+                if(shapeSpectrum(spectrum + c * bins, bins, smoothFactor, &gate, &normaliser, c)) {
+                    gated = false;
+                }
+            }
+            envelope.apply(spectrum);
+            dark = gated && isDark();
+        }
+        analysed = analysed || any;
+        return any;
+    }
+
+    int bins;
+    int channels;
+    int hop;
+    double smoothFactor;
+    bool analysed;             //spectrum holds a result
+    bool gated;                //nothing in the latest hop cleared the noise gate
+    bool dark;                 //and spectrum is all zero, envelope included
+    uint64_t frames;           //sample frames consumed, the last of them is the newest in spectrum
+    double *spectrum;          //channels*bins values, channel after channel
+    BinMap binMap;
+    NoiseGate gate;
+    BinNormaliser normaliser;
+    BinEnvelope envelope;
+    IdleDetector idle;
+
+private:
+    Analyser(const Analyser &);
+    Analyser &operator=(const Analyser &);
+
+    bool isDark() const {
+        for(int i=0; i<bins * channels; i++) {
+            if(spectrum[i] != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Stft stft;
+    FftEngine fft;
+    float *frame;              //one hop, interleaved, converted from the captured format
+};
+
+#endif
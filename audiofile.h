@@ -0,0 +1,170 @@
+#ifndef AUDIOFILE_H
+#define AUDIOFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sample.h"
+
+//Recorded audio for replay, memory mapped read only so the samples go
+//straight from the page cache into a source's ring without a read() copy.
+//"file:<path>" names one as a device. WAV files describe themselves; any
+//other file is taken as headerless interleaved PCM in the format, channels
+//and rate given on the command line.
+
+#define AUDIO_FILE_PREFIX "file:"
+
+#define WAVE_FORMAT_PCM (0x0001)
+#define WAVE_FORMAT_IEEE_FLOAT (0x0003)
+#define WAVE_FORMAT_EXTENSIBLE (0xFFFE)
+
+inline bool audioFileIsDevice(const char *device) {
+    return strncmp(device, AUDIO_FILE_PREFIX, strlen(AUDIO_FILE_PREFIX)) == 0;
+}
+
+inline uint32_t audioFileLe16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+inline uint32_t audioFileLe32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+class AudioFile
+{
+public:
+    AudioFile() : data(NULL), frames(0), frameBytes(0), format(SAMPLE_AUTO), channels(0), sampleRate(0),
+        map(NULL), mapBytes(0) {}
+    ~AudioFile() { close(); }
+
+    //Map path and find its samples. rawFormat, rawChannels and rawRate
+    //describe files without a WAV header. Prints what went wrong on failure.
+    bool open(const char *path, SampleFormat rawFormat, int rawChannels, int rawRate) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if(fd < 0) {
+            fprintf(stderr, "Could not open %s, %s\n", path, strerror(errno));
+            return false;
+        }
+        struct stat info;
+        if(fstat(fd, &info) != 0 || info.st_size == 0) {
+            fprintf(stderr, "%s is empty\n", path);
+            ::close(fd);
+            return false;
+        }
+        void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(mapped == MAP_FAILED) {
+            fprintf(stderr, "Could not map %s, %s\n", path, strerror(errno));
+            return false;
+        }
+        map = (const uint8_t *) mapped;
+        mapBytes = info.st_size;
+        //Replay reads front to back, so let the kernel read ahead aggressively
+        madvise(mapped, mapBytes, MADV_SEQUENTIAL);
+
+        size_t dataBytes;
+        if(mapBytes >= 12 && memcmp(map, "RIFF", 4) == 0 && memcmp(map + 8, "WAVE", 4) == 0) {
+            if(!parseWav(path, &dataBytes)) {
+                close();
+                return false;
+            }
+        } else {
+            data = map;
+            dataBytes = mapBytes;
+            format = rawFormat == SAMPLE_AUTO ? SAMPLE_INT16 : rawFormat;
+            channels = rawChannels;
+            sampleRate = rawRate;
+        }
+        frameBytes = sampleFormatBytes(format) * channels;
+        frames = dataBytes / frameBytes;
+        if(frames == 0) {
+            fprintf(stderr, "%s holds no whole frames\n", path);
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if(map != NULL) {
+            munmap((void *) map, mapBytes);
+        }
+        map = NULL;
+        mapBytes = 0;
+        data = NULL;
+        frames = 0;
+    }
+
+    const uint8_t *data;       //first frame, interleaved
+    uint64_t frames;
+    size_t frameBytes;
+    SampleFormat format;
+    int channels;
+    int sampleRate;
+
+private:
+    AudioFile(const AudioFile &);
+    AudioFile &operator=(const AudioFile &);
+
+    //Walk the RIFF chunks for fmt and data. Chunks are padded to even sizes
+    //and a data chunk cut short by an unfinished recording is read up to the end.
+    bool parseWav(const char *path, size_t *dataBytes) {
+        const uint8_t *fmt = NULL;
+        size_t fmtBytes = 0;
+        size_t pos = 12;
+        data = NULL;
+        while(pos + 8 <= mapBytes) {
+            size_t size = audioFileLe32(map + pos + 4);
+            size_t start = pos + 8;
+            size_t available = mapBytes - start;
+            if(memcmp(map + pos, "fmt ", 4) == 0) {
+                fmt = map + start;
+                fmtBytes = size < available ? size : available;
+            } else if(memcmp(map + pos, "data", 4) == 0) {
+                data = map + start;
+                *dataBytes = size < available ? size : available;
+                break;
+            }
+            if(size > available) {
+                break;
+            }
+            pos = start + size + (size & 1);
+        }
+        if(fmt == NULL || fmtBytes < 16 || data == NULL) {
+            fprintf(stderr, "%s is not a WAV file this can read, no fmt or data chunk\n", path);
+            return false;
+        }
+        uint32_t tag = audioFileLe16(fmt);
+        if(tag == WAVE_FORMAT_EXTENSIBLE && fmtBytes >= 26) {
+            //The first two bytes of the sub-format GUID are the plain format tag
+            tag = audioFileLe16(fmt + 24);
+        }
+        channels = audioFileLe16(fmt + 2);
+        sampleRate = audioFileLe32(fmt + 4);
+        uint32_t bits = audioFileLe16(fmt + 14);
+        format = SAMPLE_AUTO;
+        if(tag == WAVE_FORMAT_PCM) {
+            //8 bit WAV is unsigned, wider PCM signed
+            format = bits == 8 ? SAMPLE_UINT8 : bits == 16 ? SAMPLE_INT16 : bits == 24 ? SAMPLE_INT24 : SAMPLE_AUTO;
+        } else if(tag == WAVE_FORMAT_IEEE_FLOAT && bits == 32) {
+            format = SAMPLE_FLOAT32;
+        }
+        if(format == SAMPLE_AUTO || channels == 0) {
+            fprintf(stderr, "%s: unsupported WAV format %u with %u bits and %d channels\n", path, tag, bits, channels);
+            return false;
+        }
+        return true;
+    }
+
+    const uint8_t *map;
+    size_t mapBytes;
+};
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <fftw3.h>
+
+#include "bins.h"
+#include "source.h"
+
+//Microbenchmarks run with --bench instead of capturing audio.
+//They need neither a sound card nor a broker.
+//--bench-capture compares the capture modes on a real device instead, but
+//still without a broker.
+
+#define BENCH_ITERATIONS (20000)
+#define BENCH_CAPTURE_SECONDS (5)
+
+//The per-sample floor/log10 binning loop the bin map replaced
+inline void benchBinsReference(const fftw_complex *spectrum, int outputs, int bins, double *sum) {
+    for(int i=0; i<bins; i++) {
+        sum[i] = 0;
+    }
+    for(int i=1; i<outputs; i++) {
+        int index = (int) floor(i*(float)bins/(float)outputs);
+        sum[index] += log10(spectrum[i][0]*spectrum[i][0] + spectrum[i][1]*spectrum[i][1]);
+    }
+}
+
+//Time one binning function over a frame, in nanoseconds per frame
+template <typename F>
+inline double benchTime(F run) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int n=0; n<BENCH_ITERATIONS; n++) {
+        run();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / BENCH_ITERATIONS;
+}
+
+//Per-frame cost of binning before and after the bin map, for 256-8192 point frames
+inline int benchBins(int bins) {
+    printf("Binning %d bins, %d iterations per size\n", bins, BENCH_ITERATIONS);
+    printf("%8s %14s %14s %9s %12s  %s\n", "frame", "before ns", "after ns", "speedup", "max error", "kernel");
+    for(int size=256; size<=8192; size*=2) {
+        int outputs = size / 2 + 1;
+        fftw_complex *spectrum = fftw_alloc_complex(outputs);
+        double *expected = (double *) malloc(bins * sizeof(double));
+        double *actual = (double *) malloc(bins * sizeof(double));
+        BinMap map;
+        if(spectrum == NULL || expected == NULL || actual == NULL || !binMapInit(&map, bins, outputs)) {
+            printf("Could not allocate benchmark buffers.\n");
+            return 1;
+        }
+        srand(size);
+        for(int i=0; i<outputs; i++) {
+            spectrum[i][0] = (rand() - RAND_MAX / 2) * (32768.0 / RAND_MAX) * size;
+            spectrum[i][1] = (rand() - RAND_MAX / 2) * (32768.0 / RAND_MAX) * size;
+        }
+
+        double before = benchTime([&]() { benchBinsReference(spectrum, outputs, bins, expected); });
+        double after = benchTime([&]() { binMapApply(&map, spectrum, actual); });
+
+        double error = 0;
+        for(int i=0; i<bins; i++) {
+            double e = fabs(actual[i] - expected[i]) / (fabs(expected[i]) > 1 ? fabs(expected[i]) : 1);
+            if(e > error) {
+                error = e;
+            }
+        }
+        printf("%8d %14.1f %14.1f %8.2fx %12.2e  %s\n", size, before, after, before / after, error, map.kernelName);
+
+        binMapFree(&map);
+        free(expected);
+        free(actual);
+        fftw_free(spectrum);
+    }
+    return 0;
+}
+
+//Per-frame cost of the log, mel and bark filterbanks next to the linear
+//map, for 256-8192 point frames at sampleRate. The error is the picked
+//filterbank kernel's against the scalar one.
+inline int benchFilterbank(int bins, int sampleRate) {
+    printf("\nFilterbank binning %d bins at %d Hz, %d iterations per size\n", bins, sampleRate, BENCH_ITERATIONS);
+    printf("%8s %14s %14s %14s %14s %12s  %s\n", "frame", "linear ns", "log ns", "mel ns", "bark ns", "max error", "kernel");
+    for(int size=256; size<=8192; size*=2) {
+        int outputs = size / 2 + 1;
+        fftw_complex *spectrum = fftw_alloc_complex(outputs);
+        double *expected = (double *) malloc(bins * sizeof(double));
+        double *actual = (double *) malloc(bins * sizeof(double));
+        if(spectrum == NULL || expected == NULL || actual == NULL) {
+            printf("Could not allocate benchmark buffers.\n");
+            return 1;
+        }
+        srand(size);
+        for(int i=0; i<outputs; i++) {
+            spectrum[i][0] = (rand() - RAND_MAX / 2) * (32768.0 / RAND_MAX) * size;
+            spectrum[i][1] = (rand() - RAND_MAX / 2) * (32768.0 / RAND_MAX) * size;
+        }
+
+        double ns[BIN_BARK + 1];
+        double error = 0;
+        const char *kernelName = "";
+        for(int layout=BIN_LINEAR; layout<=BIN_BARK; layout++) {
+            FilterbankConfig config;
+            filterbankConfigDefaults(&config);
+            config.layout = (BinLayout) layout;
+            BinMap map;
+            if(!binMapInitLayout(&map, bins, outputs, config, (double) sampleRate / size)) {
+                printf("Could not build the %s filterbank.\n", configLayoutNames[layout]);
+                binMapFree(&map);
+                return 1;
+            }
+            ns[layout] = benchTime([&]() { binMapApply(&map, spectrum, actual); });
+            if(layout != BIN_LINEAR) {
+                filterbankKernelScalar(&map, spectrum, expected);
+                for(int i=0; i<bins; i++) {
+                    double e = fabs(actual[i] - expected[i]) / (fabs(expected[i]) > 1 ? fabs(expected[i]) : 1);
+                    if(e > error) {
+                        error = e;
+                    }
+                }
+                kernelName = map.kernelName;
+            }
+            binMapFree(&map);
+        }
+        printf("%8d %14.1f %14.1f %14.1f %14.1f %12.2e  %s\n", size, ns[BIN_LINEAR], ns[BIN_LOG], ns[BIN_MEL], ns[BIN_BARK],
+            error, kernelName);
+
+        free(expected);
+        free(actual);
+        fftw_free(spectrum);
+    }
+    return 0;
+}
+
+//Time converting a hop of captured samples to float with the scalar kernel
+//and with the one picked for the CPU
+template <typename T>
+inline void benchConvertFormat(size_t n) {
+    T *in = (T *) malloc(n * sizeof(T));
+    float *expected = (float *) malloc(n * sizeof(float));
+    float *actual = (float *) malloc(n * sizeof(float));
+    if(in == NULL || expected == NULL || actual == NULL) {
+        printf("Could not allocate benchmark buffers.\n");
+    } else {
+        srand(n);
+        for(size_t i=0; i<n * sizeof(T); i++) {
+            ((unsigned char *) in)[i] = rand();
+        }
+        if(SampleTraits<T>::format() == SAMPLE_FLOAT32) {
+            for(size_t i=0; i<n; i++) {
+                ((float *) in)[i] = rand() * 2.0f / RAND_MAX - 1;
+            }
+        }
+        const char *name;
+        SampleKernel kernel = sampleKernel<T>(&name);
+        double before = benchTime([&]() { sampleKernelScalar<T>(in, expected, n); });
+        double after = benchTime([&]() { kernel(in, actual, n); });
+        float error = 0;
+        for(size_t i=0; i<n; i++) {
+            error = fabsf(actual[i] - expected[i]) > error ? fabsf(actual[i] - expected[i]) : error;
+        }
+        printf("%8s %14.1f %14.1f %8.2fx %12.2e  %s\n", sampleFormatName(SampleTraits<T>::format()),
+            before, after, before / after, error, name);
+    }
+    free(in);
+    free(expected);
+    free(actual);
+}
+
+inline int benchConvert(size_t n) {
+    printf("\nConverting %lu samples to float, %d iterations per format\n", (unsigned long) n, BENCH_ITERATIONS);
+    printf("%8s %14s %14s %9s %12s  %s\n", "format", "scalar ns", "kernel ns", "speedup", "max error", "kernel");
+    benchConvertFormat<int8_t>(n);
+    benchConvertFormat<uint8_t>(n);
+    benchConvertFormat<int16_t>(n);
+    benchConvertFormat<Int24>(n);
+    benchConvertFormat<float>(n);
+    return 0;
+}
+
+//Capture from the first source with each mode in turn, draining its ring as
+//the analysis would. Reports the producer's cost per block (wall time in the
+//callback, cpu time on the capture thread), how long after the signal the
+//consumer woke, what was lost, and the whole process's cpu use.
+inline int benchCapture(const Config &config) {
+    PaError err = Pa_Initialize();
+    if(err != paNoError) {
+        printf("Could not initialise portaudio: %s\n", Pa_GetErrorText(err));
+        return 1;
+    }
+    printf("Capturing %d s per mode, %d frames per buffer at %d Hz\n",
+        BENCH_CAPTURE_SECONDS, config.framesPerBuffer, config.sampleRate);
+    printf("%-10s %8s %12s %12s %12s %12s %10s %9s %6s\n", "mode", "blocks", "block us", "worst us",
+        "wake us", "worst us", "overflows", "dropped", "cpu %");
+    int status = 0;
+    for(int mode=CAPTURE_CALLBACK; mode<=CAPTURE_BLOCKING; mode++) {
+        Config settings = config;
+        settings.capture = (CaptureMode) mode;
+        FftPlanCache plans;
+        Source source;
+        if(!source.init(0, config.sources[0], settings, &plans, NULL)) {
+            printf("Could not set up the source.\n");
+            status = 1;
+            break;
+        }
+        float *hop = (float *) malloc(source.wakeSamples * sizeof(float));
+        FrameSignal *signals[1] = { &source.signal };
+        struct pollfd fds[1];
+        bool ready[1];
+        unsigned long wakes = 0;
+        int64_t wakeNs = 0, worstWake = 0;
+
+        err = source.open(settings);
+        if(hop == NULL || err != paNoError) {
+            printf("Could not open the source: %s\n", Pa_GetErrorText(err));
+            free(hop);
+            status = 1;
+            break;
+        }
+        struct timespec cpuStart, cpuEnd;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuStart);
+        int64_t start = monotonicNow();
+        int64_t end = start + BENCH_CAPTURE_SECONDS * 1000000000LL;
+        while(monotonicNow() < end) {
+            waitAny(signals, fds, ready, 1, end);
+            if(ready[0]) {
+                int64_t wake = monotonicNow() - source.stats.lastNotify.load(std::memory_order_relaxed);
+                wakeNs += wake;
+                worstWake = wake > worstWake ? wake : worstWake;
+                wakes++;
+            }
+            while(source.samples->popFloat(hop, source.wakeSamples)) {
+            }
+        }
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuEnd);
+        double elapsed = (monotonicNow() - start) / 1e9;
+        source.close();
+
+        unsigned long blocks = source.stats.blocks.load();
+        double cpu = (cpuEnd.tv_sec - cpuStart.tv_sec) + (cpuEnd.tv_nsec - cpuStart.tv_nsec) / 1e9;
+        printf("%-10s %8lu %12.1f %12.1f %12.1f %12.1f %10lu %9lu %6.2f\n",
+            mode == CAPTURE_CALLBACK ? "callback" : "blocking", blocks,
+            blocks ? source.stats.busyNs.load() / 1e3 / blocks : 0.0, source.stats.worstNs.load() / 1e3,
+            wakes ? wakeNs / 1e3 / wakes : 0.0, worstWake / 1e3,
+            source.stats.overflows.load(), source.stats.dropped.load(), 100 * cpu / elapsed);
+        free(hop);
+    }
+    Pa_Terminate();
+    return status;
+}
+
+#endif
@@ -0,0 +1,452 @@
+#ifndef BINS_H
+#define BINS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fftw3.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BINS_X86 (1)
+#endif
+
+//Downsampling of an FFT power spectrum to the LED bins.
+//With the linear layout, output i (from 1, DC is skipped) belongs to bin
+//floor(i*bins/outputs), which makes every bin a contiguous run of outputs.
+//The run edges are computed once at startup and a kernel picked for the CPU
+//then sums log10(re*re+im*im) over each run in a single pass, with no
+//per-sample floor or libm log10.
+//
+//The log, mel and bark layouts space the bins evenly on that scale instead,
+//so bass gets as many LEDs as treble, as overlapping triangular filters.
+//The filters are a sparse weight matrix in CSR form built once at startup.
+//Each frame the power of every output is computed once, then each bin is the
+//log10 of its weighted sum. A filter's outputs are consecutive, so each row
+//is a dense dot product the kernels vectorise without gathers, and only one
+//log per bin is taken rather than one per output.
+
+enum BinLayout
+{
+    BIN_LINEAR,
+    BIN_LOG,
+    BIN_MEL,
+    BIN_BARK
+};
+
+typedef struct
+{
+    BinLayout layout;
+    double minHz;              //lowest filter edge for the log, mel and bark layouts
+    double maxHz;              //highest, 0 for the Nyquist frequency
+}
+FilterbankConfig;
+
+inline void filterbankConfigDefaults(FilterbankConfig *config) {
+    config->layout = BIN_LINEAR;
+    config->minHz = 40;
+    config->maxHz = 0;
+}
+
+//log10 via Paul Mineiro's fastlog2, accurate to about 1e-4.
+//Zero power gives -inf, the same as log10(0), so silent bins still fall out.
+inline float fastLog10(float x) {
+    union { float f; uint32_t i; } vx, mx;
+    vx.f = x;
+    mx.i = (vx.i & 0x007FFFFF) | 0x3f000000;
+    float y = vx.i * 1.1920928955078125e-7f;
+    float log2 = y - 124.22551499f - 1.498030302f * mx.f - 1.72587999f / (0.3520887068f + mx.f);
+    return x == 0 ? -INFINITY : log2 * 0.30102999566f;
+}
+
+typedef struct BinMap BinMap;
+typedef void (*BinKernel)(const BinMap *map, const fftw_complex *spectrum, double *sum);
+
+struct BinMap
+{
+    int bins;
+    int outputs;
+    BinLayout layout;
+    int *edges;          //linear: bin b covers outputs [edges[b], edges[b+1])
+    int *rows;           //filterbank: bin b's weights are [rows[b], rows[b+1])
+    int *columns;        //the output each weight applies to, consecutive within a row
+    float *weights;      //each row sums to 1
+    float *power;        //per output, scratch for the frame being binned
+    int powerStart;      //outputs any filter uses are [powerStart, powerEnd)
+    int powerEnd;
+    BinKernel kernel;
+    const char *kernelName;
+};
+
+inline void binKernelScalar(const BinMap *map, const fftw_complex *spectrum, double *sum) {
+    for(int b=0; b<map->bins; b++) {
+        float acc = 0;
+        for(int i=map->edges[b]; i<map->edges[b+1]; i++) {
+            acc += fastLog10((float) (spectrum[i][0]*spectrum[i][0] + spectrum[i][1]*spectrum[i][1]));
+        }
+        sum[b] = acc;
+    }
+}
+
+inline float filterbankDot(const float *weights, const float *power, int n) {
+    float acc = 0;
+    for(int i=0; i<n; i++) {
+        acc += weights[i] * power[i];
+    }
+    return acc;
+}
+
+inline void filterbankKernelScalar(const BinMap *map, const fftw_complex *spectrum, double *sum) {
+    for(int i=map->powerStart; i<map->powerEnd; i++) {
+        map->power[i] = (float) (spectrum[i][0]*spectrum[i][0] + spectrum[i][1]*spectrum[i][1]);
+    }
+    for(int b=0; b<map->bins; b++) {
+        int start = map->rows[b];
+        sum[b] = fastLog10(filterbankDot(map->weights + start, map->power + map->columns[start], map->rows[b+1] - start));
+    }
+}
+
+#ifdef BINS_X86
+inline __m128 fastLog10Sse(__m128 x) {
+    __m128i bits = _mm_castps_si128(x);
+    __m128 mx = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_set1_epi32(0x3f000000)));
+    __m128 y = _mm_mul_ps(_mm_cvtepi32_ps(bits), _mm_set1_ps(1.1920928955078125e-7f));
+    __m128 log2 = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(y, _mm_set1_ps(124.22551499f)),
+                             _mm_mul_ps(_mm_set1_ps(1.498030302f), mx)),
+                             _mm_div_ps(_mm_set1_ps(1.72587999f), _mm_add_ps(_mm_set1_ps(0.3520887068f), mx)));
+    __m128 result = _mm_mul_ps(log2, _mm_set1_ps(0.30102999566f));
+    __m128 zero = _mm_cmpeq_ps(x, _mm_setzero_ps());
+    return _mm_or_ps(_mm_andnot_ps(zero, result), _mm_and_ps(zero, _mm_set1_ps(-INFINITY)));
+}
+
+//Power of two adjacent complex outputs as doubles
+inline __m128d powerSse(const double *p) {
+    __m128d a = _mm_loadu_pd(p);
+    __m128d b = _mm_loadu_pd(p + 2);
+    a = _mm_mul_pd(a, a);
+    b = _mm_mul_pd(b, b);
+    return _mm_add_pd(_mm_unpacklo_pd(a, b), _mm_unpackhi_pd(a, b));
+}
+
+inline void binKernelSse2(const BinMap *map, const fftw_complex *spectrum, double *sum) {
+    for(int b=0; b<map->bins; b++) {
+        int i = map->edges[b];
+        int end = map->edges[b+1];
+        __m128 acc = _mm_setzero_ps();
+        for(; i+4<=end; i+=4) {
+            __m128 lo = _mm_cvtpd_ps(powerSse(&spectrum[i][0]));
+            __m128 hi = _mm_cvtpd_ps(powerSse(&spectrum[i+2][0]));
+            acc = _mm_add_ps(acc, fastLog10Sse(_mm_movelh_ps(lo, hi)));
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, acc);
+        float total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        for(; i<end; i++) {
+            total += fastLog10((float) (spectrum[i][0]*spectrum[i][0] + spectrum[i][1]*spectrum[i][1]));
+        }
+        sum[b] = total;
+    }
+}
+
+inline void filterbankKernelSse2(const BinMap *map, const fftw_complex *spectrum, double *sum) {
+    int i = map->powerStart;
+    for(; i+4<=map->powerEnd; i+=4) {
+        __m128 lo = _mm_cvtpd_ps(powerSse(&spectrum[i][0]));
+        __m128 hi = _mm_cvtpd_ps(powerSse(&spectrum[i+2][0]));
+        _mm_storeu_ps(map->power + i, _mm_movelh_ps(lo, hi));
+    }
+    for(; i<map->powerEnd; i++) {
+        map->power[i] = (float) (spectrum[i][0]*spectrum[i][0] + spectrum[i][1]*spectrum[i][1]);
+    }
+    for(int b=0; b<map->bins; b++) {
+        int start = map->rows[b];
+        int n = map->rows[b+1] - start;
+        const float *weights = map->weights + start;
+        const float *power = map->power + map->columns[start];
+        __m128 acc = _mm_setzero_ps();
+        __m128 acc2 = _mm_setzero_ps();
+        int k = 0;
+        for(; k+8<=n; k+=8) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(weights + k), _mm_loadu_ps(power + k)));
+            acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_loadu_ps(weights + k + 4), _mm_loadu_ps(power + k + 4)));
+        }
+        for(; k+4<=n; k+=4) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(weights + k), _mm_loadu_ps(power + k)));
+        }
+        acc = _mm_add_ps(acc, acc2);
+        float lanes[4];
+        _mm_storeu_ps(lanes, acc);
+        float total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + filterbankDot(weights + k, power + k, n - k);
+        sum[b] = fastLog10(total);
+    }
+}
+
+__attribute__((target("avx2")))
+inline __m256 fastLog10Avx2(__m256 x) {
+    __m256i bits = _mm256_castps_si256(x);
+    __m256 mx = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)), _mm256_set1_epi32(0x3f000000)));
+    __m256 y = _mm256_mul_ps(_mm256_cvtepi32_ps(bits), _mm256_set1_ps(1.1920928955078125e-7f));
+    __m256 log2 = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(y, _mm256_set1_ps(124.22551499f)),
+                                _mm256_mul_ps(_mm256_set1_ps(1.498030302f), mx)),
+                                _mm256_div_ps(_mm256_set1_ps(1.72587999f), _mm256_add_ps(_mm256_set1_ps(0.3520887068f), mx)));
+    __m256 result = _mm256_mul_ps(log2, _mm256_set1_ps(0.30102999566f));
+    __m256 zero = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_EQ_OQ);
+    return _mm256_blendv_ps(result, _mm256_set1_ps(-INFINITY), zero);
+}
+
+//Power of four adjacent complex outputs, in the order 0, 2, 1, 3. The kernel
+//only ever sums them so the order does not matter.
+__attribute__((target("avx2")))
+inline __m128 powerAvx2(const double *p) {
+    __m256d a = _mm256_loadu_pd(p);
+    __m256d b = _mm256_loadu_pd(p + 4);
+    return _mm256_cvtpd_ps(_mm256_hadd_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b)));
+}
+
+__attribute__((target("avx2")))
+inline void binKernelAvx2(const BinMap *map, const fftw_complex *spectrum, double *sum) {
+    for(int b=0; b<map->bins; b++) {
+        int i = map->edges[b];
+        int end = map->edges[b+1];
+        __m256 acc = _mm256_setzero_ps();
+        for(; i+8<=end; i+=8) {
+            __m256 power = _mm256_insertf128_ps(_mm256_castps128_ps256(powerAvx2(&spectrum[i][0])),
+                                                powerAvx2(&spectrum[i+4][0]), 1);
+            acc = _mm256_add_ps(acc, fastLog10Avx2(power));
+        }
+        float lanes[8];
+        _mm256_storeu_ps(lanes, acc);
+        float total = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+        for(; i<end; i++) {
+            total += fastLog10((float) (spectrum[i][0]*spectrum[i][0] + spectrum[i][1]*spectrum[i][1]));
+        }
+        sum[b] = total;
+    }
+}
+
+__attribute__((target("avx2")))
+inline void filterbankKernelAvx2(const BinMap *map, const fftw_complex *spectrum, double *sum) {
+    int i = map->powerStart;
+    //hadd leaves the powers in the order 0, 2, 1, 3 in each half; the dot products need them in order
+    const __m256i order = _mm256_setr_epi32(0, 2, 1, 3, 4, 6, 5, 7);
+    for(; i+8<=map->powerEnd; i+=8) {
+        __m256d a = _mm256_loadu_pd(&spectrum[i][0]);
+        __m256d b = _mm256_loadu_pd(&spectrum[i+2][0]);
+        __m256d c = _mm256_loadu_pd(&spectrum[i+4][0]);
+        __m256d d = _mm256_loadu_pd(&spectrum[i+6][0]);
+        __m128 low = _mm256_cvtpd_ps(_mm256_hadd_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b)));
+        __m128 high = _mm256_cvtpd_ps(_mm256_hadd_pd(_mm256_mul_pd(c, c), _mm256_mul_pd(d, d)));
+        __m256 power = _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1);
+        _mm256_storeu_ps(map->power + i, _mm256_permutevar8x32_ps(power, order));
+    }
+    for(; i<map->powerEnd; i++) {
+        map->power[i] = (float) (spectrum[i][0]*spectrum[i][0] + spectrum[i][1]*spectrum[i][1]);
+    }
+    for(int b=0; b<map->bins; b++) {
+        int start = map->rows[b];
+        int n = map->rows[b+1] - start;
+        const float *weights = map->weights + start;
+        const float *power = map->power + map->columns[start];
+        //Two accumulators so wide filters are not held up by the add latency
+        __m256 acc = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        int k = 0;
+        for(; k+16<=n; k+=16) {
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(weights + k), _mm256_loadu_ps(power + k)));
+            acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(_mm256_loadu_ps(weights + k + 8), _mm256_loadu_ps(power + k + 8)));
+        }
+        for(; k+8<=n; k+=8) {
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(weights + k), _mm256_loadu_ps(power + k)));
+        }
+        acc = _mm256_add_ps(acc, acc2);
+        float lanes[8];
+        _mm256_storeu_ps(lanes, acc);
+        float total = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]))
+            + filterbankDot(weights + k, power + k, n - k);
+        sum[b] = fastLog10(total);
+    }
+}
+#endif
+
+//Build the run edges for spreading outputs FFT outputs over bins, and pick
+//the widest kernel the CPU supports
+inline bool binMapInit(BinMap *map, int bins, int outputs) {
+    map->bins = bins;
+    map->outputs = outputs;
+    map->layout = BIN_LINEAR;
+    map->powerStart = 0;
+    map->powerEnd = 0;
+    map->rows = NULL;
+    map->columns = NULL;
+    map->weights = NULL;
+    map->power = NULL;
+    map->edges = (int *) malloc((bins + 1) * sizeof(int));
+    if(map->edges == NULL) {
+        return false;
+    }
+    int b = 0;
+    map->edges[0] = 1;
+    for(int i=1; i<outputs; i++) {
+        int index = (int) ((long long) i * bins / outputs);
+        while(b < index) {
+            map->edges[++b] = i;
+        }
+    }
+    while(b < bins) {
+        map->edges[++b] = outputs;
+    }
+
+    map->kernel = binKernelScalar;
+    map->kernelName = "scalar";
+#ifdef BINS_X86
+    map->kernel = binKernelSse2;
+    map->kernelName = "sse2";
+    if(__builtin_cpu_supports("avx2")) {
+        map->kernel = binKernelAvx2;
+        map->kernelName = "avx2";
+    }
+#endif
+    return true;
+}
+
+//Position of hz on layout's scale
+inline double binScale(BinLayout layout, double hz) {
+    switch(layout) {
+        case BIN_LOG:  return log(hz);
+        case BIN_MEL:  return 2595 * log10(1 + hz / 700);
+        case BIN_BARK: return 26.81 * hz / (1960 + hz) - 0.53;     //Traunmuller
+        default:       return hz;
+    }
+}
+
+inline double binScaleInverse(BinLayout layout, double position) {
+    switch(layout) {
+        case BIN_LOG:  return exp(position);
+        case BIN_MEL:  return 700 * (pow(10, position / 2595) - 1);
+        case BIN_BARK: return 1960 * (position + 0.53) / (26.28 - position);
+        default:       return position;
+    }
+}
+
+//Build the filterbank for a log, mel or bark layout, or the runs for linear.
+//outputHz is the spacing of the FFT outputs, sample rate over frame size.
+//Filter b rises from point b to point b+1 and falls to point b+2, with the
+//bins+2 points evenly spaced on the scale between minHz and maxHz. A filter
+//narrower than the output spacing, at the bottom of the log scale, takes
+//the output nearest its centre so that no bin is left empty.
+inline bool binMapInitLayout(BinMap *map, int bins, int outputs, const FilterbankConfig &config, double outputHz) {
+    if(config.layout == BIN_LINEAR) {
+        return binMapInit(map, bins, outputs);
+    }
+    map->bins = bins;
+    map->outputs = outputs;
+    map->layout = config.layout;
+    map->edges = NULL;
+    int capacity = 2 * outputs + bins;
+    map->rows = (int *) malloc((bins + 1) * sizeof(int));
+    map->columns = (int *) malloc(capacity * sizeof(int));
+    map->weights = (float *) malloc(capacity * sizeof(float));
+    map->power = (float *) calloc(outputs, sizeof(float));
+    if(map->rows == NULL || map->columns == NULL || map->weights == NULL || map->power == NULL) {
+        return false;
+    }
+
+    double nyquist = outputHz * (outputs - 1);
+    double maxHz = config.maxHz > 0 && config.maxHz < nyquist ? config.maxHz : nyquist;
+    double minHz = config.minHz > outputHz ? config.minHz : outputHz;
+    if(minHz >= maxHz) {
+        return false;
+    }
+    double low = binScale(config.layout, minHz);
+    double high = binScale(config.layout, maxHz);
+    int count = 0;
+    map->powerStart = outputs;
+    map->powerEnd = 0;
+    for(int b=0; b<bins; b++) {
+        double left = binScaleInverse(config.layout, low + (high - low) * b / (bins + 1));
+        double centre = binScaleInverse(config.layout, low + (high - low) * (b + 1) / (bins + 1));
+        double right = binScaleInverse(config.layout, low + (high - low) * (b + 2) / (bins + 1));
+        map->rows[b] = count;
+        int first = (int) ceil(left / outputHz);
+        int last = (int) floor(right / outputHz);
+        first = first < 1 ? 1 : first;
+        last = last > outputs - 1 ? outputs - 1 : last;
+        double total = 0;
+        for(int k=first; k<=last; k++) {
+            double hz = k * outputHz;
+            double weight = hz < centre ? (hz - left) / (centre - left) : (right - hz) / (right - centre);
+            if(weight <= 0 && count == map->rows[b]) {
+                continue;
+            }
+            map->columns[count] = k;
+            map->weights[count] = (float) (weight > 0 ? weight : 0);
+            total += map->weights[count];
+            count++;
+        }
+        //Trailing zero weights from the falling edge landing on an output
+        while(count > map->rows[b] && map->weights[count - 1] == 0) {
+            count--;
+        }
+        if(total <= 0) {
+            int nearest = (int) floor(centre / outputHz + 0.5);
+            count = map->rows[b];
+            map->columns[count] = nearest < 1 ? 1 : nearest > outputs - 1 ? outputs - 1 : nearest;
+            map->weights[count] = 1;
+            total = 1;
+            count++;
+        }
+        for(int i=map->rows[b]; i<count; i++) {
+            map->weights[i] = (float) (map->weights[i] / total);
+        }
+        if(map->columns[map->rows[b]] < map->powerStart) {
+            map->powerStart = map->columns[map->rows[b]];
+        }
+        if(map->columns[count - 1] + 1 > map->powerEnd) {
+            map->powerEnd = map->columns[count - 1] + 1;
+        }
+    }
+    map->rows[bins] = count;
+
+    map->kernel = filterbankKernelScalar;
+    map->kernelName = "scalar filterbank";
+#ifdef BINS_X86
+    map->kernel = filterbankKernelSse2;
+    map->kernelName = "sse2 filterbank";
+    if(__builtin_cpu_supports("avx2")) {
+        map->kernel = filterbankKernelAvx2;
+        map->kernelName = "avx2 filterbank";
+    }
+#endif
+    return true;
+}
+
+inline void binMapFree(BinMap *map) {
+    free(map->edges);
+    free(map->rows);
+    free(map->columns);
+    free(map->weights);
+    free(map->power);
+    map->edges = NULL;
+    map->rows = NULL;
+    map->columns = NULL;
+    map->weights = NULL;
+    map->power = NULL;
+}
+
+//How far bin b's value moves for 10 dB more power. A linear bin sums the
+//log power of its outputs, so that is how many outputs it covers; a filter
+//takes the log of its weighted sum, so it is one.
+inline int binMapUnits(const BinMap *map, int b) {
+    if(map->layout != BIN_LINEAR) {
+        return 1;
+    }
+    return map->edges[b + 1] - map->edges[b];
+}
+
+//Write the log power of each bin into sum
+inline void binMapApply(const BinMap *map, const fftw_complex *spectrum, double *sum) {
+    map->kernel(map, spectrum, sum);
+}
+
+#endif
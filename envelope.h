@@ -0,0 +1,112 @@
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+#include <stdlib.h>
+#include <math.h>
+
+//Levels below this are too dim to show, and become exactly zero rather than
+//decaying forever
+#define ENVELOPE_SILENT (1e-3)
+
+//Smoothing of each bin over time, after the spectrum has been shaped.
+//A bin follows rises with the attack time constant and falls with the
+//release one, as an LED meter's ballistics do, so single frames no longer
+//flicker. Peak hold keeps each bin's highest level for a while and then lets
+//it fall at a fixed rate; what is published is the higher of the two, so
+//bars drop slowly after a hit. All times 0 leaves the spectrum untouched.
+typedef struct
+{
+    double attackMs;           //time constant of rises, 0 to follow instantly
+    double releaseMs;          //time constant of falls, 0 to follow instantly
+    double holdMs;             //how long a peak is held, 0 for no peak hold
+    double peakDecay;          //levels (0-1) per second a peak falls once its hold is over
+}
+EnvelopeConfig;
+
+inline void envelopeConfigDefaults(EnvelopeConfig *config) {
+    config->attackMs = 0;
+    config->releaseMs = 0;
+    config->holdMs = 0;
+    config->peakDecay = 1;
+}
+
+//Per bin envelope state, preallocated for every bin of every channel and
+//updated once per analysed hop. Only one thread may use it at a time.
+class BinEnvelope
+{
+public:
+    BinEnvelope() : count(0), attack(0), release(0), holdHops(0), decayPerHop(0), enabled(false),
+        level(NULL), peak(NULL), held(NULL) {}
+    ~BinEnvelope() {
+        free(level);
+        free(peak);
+        free(held);
+    }
+
+    //count values, updated every hopSeconds
+    bool init(size_t valueCount, double hopSeconds, const EnvelopeConfig &config) {
+        count = valueCount;
+        //One pole coefficients: the share of the old level kept each hop
+        attack = config.attackMs > 0 ? exp(-hopSeconds * 1000 / config.attackMs) : 0;
+        release = config.releaseMs > 0 ? exp(-hopSeconds * 1000 / config.releaseMs) : 0;
+        holdHops = config.holdMs > 0 ? (int) ceil(config.holdMs / 1000 / hopSeconds) : 0;
+        decayPerHop = config.peakDecay * hopSeconds;
+        enabled = attack > 0 || release > 0 || holdHops > 0;
+        free(level);
+        free(peak);
+        free(held);
+        level = (double *) calloc(count, sizeof(double));
+        peak = (double *) calloc(count, sizeof(double));
+        held = (int *) calloc(count, sizeof(int));
+        return level != NULL && peak != NULL && held != NULL;
+    }
+
+    //Replace values with their envelope, in place
+    void apply(double *values) {
+        if(!enabled) {
+            return;
+        }
+        for(size_t i=0; i<count; i++) {
+            double x = values[i];
+            double keep = x > level[i] ? attack : release;
+            level[i] = x + keep * (level[i] - x);
+            if(level[i] < ENVELOPE_SILENT) {
+                level[i] = 0;
+            }
+            values[i] = level[i];
+        }
+        if(holdHops == 0) {
+            return;
+        }
+        for(size_t i=0; i<count; i++) {
+            if(values[i] >= peak[i]) {
+                peak[i] = values[i];
+                held[i] = holdHops;
+            } else if(held[i] > 0) {
+                held[i]--;
+            } else {
+                peak[i] -= decayPerHop;
+                if(peak[i] < values[i]) {
+                    peak[i] = values[i];
+                }
+            }
+            values[i] = peak[i];
+        }
+    }
+
+private:
+    BinEnvelope(const BinEnvelope &);
+    BinEnvelope &operator=(const BinEnvelope &);
+
+    size_t count;
+    double attack;             //share of the old level kept per hop when rising
+    double release;            //and when falling
+    int holdHops;
+    double decayPerHop;
+    bool enabled;
+    double *level;             //smoothed level per value
+    double *peak;              //held peak per value
+    int *held;                 //hops each peak has left to hold
+};
+
+#endif
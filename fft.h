@@ -0,0 +1,226 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <fftw3.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "wisdom.h"
+
+//Everything in FFTW apart from fftw_execute* must be called from one thread
+//at a time, so all planning, plan destruction and wisdom I/O goes through this.
+inline std::mutex &fftPlannerLock() {
+    static std::mutex lock;
+    return lock;
+}
+
+//Real to complex FFT plan over one frame of samples per channel.
+//Audio is purely real, so this transforms size doubles into size/2+1 complex
+//outputs instead of running a full complex DFT whose imaginary input is zero.
+//Channels are planar: channel c's frame starts at input + c*size and its
+//spectrum at output + c*outputs, and all of them go through one batched
+//fftw_plan_many_dft_r2c plan.
+//A plan is planned on scratch buffers and only ever run through the
+//new-array fftw_execute_dft_r2c, so any number of sources with the same
+//shape can share it from any thread, each with its own FftEngine buffers.
+class FftPlan
+{
+public:
+    FftPlan() : size(0), outputs(0), channels(0), current(NULL), retired(NULL) {
+        wisdomPath[0] = '\0';
+    }
+    ~FftPlan() { destroy(); }
+
+    //Wisdom is imported from wisdomDir first, and if that already holds a plan
+    //for this shape it is used straight away. Otherwise the plan is measured
+    //with flags and the wisdom written back. With fastStart the plan begins as
+    //FFTW_ESTIMATE and the measured one replaces it once a background thread
+    //has finished planning it.
+    bool init(int frameSize, int channelCount, unsigned flags, const char *wisdomDir, bool fastStart) {
+        destroy();
+        size = frameSize;
+        outputs = frameSize / 2 + 1;
+        channels = channelCount;
+
+        std::lock_guard<std::mutex> guard(fftPlannerLock());
+        if(wisdomDir != NULL) {
+            char type[32];
+            snprintf(type, sizeof(type), "r2c-x%d", channels);
+            wisdomFileName(wisdomPath, sizeof(wisdomPath), wisdomDir, type, size);
+            if(wisdomImport(wisdomPath)) {
+                printf("Loaded fft wisdom from %s\n", wisdomPath);
+            }
+        }
+        fftw_plan plan = makePlan(flags | FFTW_WISDOM_ONLY);
+        if(plan == NULL && (flags & FFTW_ESTIMATE)) {
+            plan = makePlan(flags);
+        }
+        if(plan != NULL) {
+            current.store(plan);
+            return true;
+        }
+
+        if(fastStart) {
+            plan = makePlan(FFTW_ESTIMATE);
+            if(plan == NULL) {
+                return false;
+            }
+            current.store(plan);
+            planner = std::thread(&FftPlan::measure, this, flags);
+            return true;
+        }
+
+        plan = makePlan(flags);
+        if(plan != NULL && wisdomPath[0]) {
+            wisdomExport(wisdomPath);
+        }
+        current.store(plan);
+        return plan != NULL;
+    }
+
+    //Transform input into output, both allocated with the fftw allocators
+    void execute(double *input, fftw_complex *output) const {
+        fftw_execute_dft_r2c(current.load(std::memory_order_acquire), input, output);
+    }
+
+    void destroy() {
+        if(planner.joinable()) {
+            planner.join();
+        }
+        std::lock_guard<std::mutex> guard(fftPlannerLock());
+        fftw_plan plan = current.exchange(NULL);
+        if(plan != NULL) {
+            fftw_destroy_plan(plan);
+        }
+        if(retired != NULL) {
+            fftw_destroy_plan(retired);
+        }
+        retired = NULL;
+    }
+
+    int size;              //real samples per frame, per channel
+    int outputs;           //complex outputs per channel, size/2+1
+    int channels;
+
+private:
+    FftPlan(const FftPlan &);
+    FftPlan &operator=(const FftPlan &);
+
+    //Caller holds the planner lock. Measuring scribbles over the arrays, so
+    //plans are always made on scratch buffers with fftw's usual alignment.
+    fftw_plan makePlan(unsigned flags) {
+        double *scratchIn = fftw_alloc_real(size * channels);
+        fftw_complex *scratchOut = fftw_alloc_complex(outputs * channels);
+        fftw_plan plan = NULL;
+        if(scratchIn != NULL && scratchOut != NULL) {
+            plan = fftw_plan_many_dft_r2c(1, &size, channels,
+                scratchIn, NULL, 1, size,
+                scratchOut, NULL, 1, outputs,
+                flags);
+        }
+        fftw_free(scratchIn);
+        fftw_free(scratchOut);
+        return plan;
+    }
+
+    //Background planner. The estimated plan may still be running on other
+    //threads, so it is kept until destroy() rather than destroyed on the swap.
+    void measure(unsigned flags) {
+        std::lock_guard<std::mutex> guard(fftPlannerLock());
+        fftw_plan measured = makePlan(flags);
+        if(measured == NULL) {
+            return;
+        }
+        if(wisdomPath[0]) {
+            wisdomExport(wisdomPath);
+        }
+        retired = current.exchange(measured, std::memory_order_acq_rel);
+        printf("Switched to measured fft plan for %d x %d.\n", channels, size);
+    }
+
+    std::atomic<fftw_plan> current;
+    fftw_plan retired;
+    std::thread planner;
+    char wisdomPath[512];
+};
+
+//One plan per frame shape, shared by every source with that shape
+class FftPlanCache
+{
+public:
+    FftPlanCache() {}
+    ~FftPlanCache() {
+        for(size_t i=0; i<plans.size(); i++) {
+            delete plans[i];
+        }
+    }
+
+    //Called while sources are set up, not from the analysis threads
+    FftPlan *get(int frameSize, int channels, unsigned flags, const char *wisdomDir, bool fastStart) {
+        for(size_t i=0; i<plans.size(); i++) {
+            if(plans[i]->size == frameSize && plans[i]->channels == channels) {
+                return plans[i];
+            }
+        }
+        FftPlan *plan = new FftPlan();
+        if(!plan->init(frameSize, channels, flags, wisdomDir, fastStart)) {
+            delete plan;
+            return NULL;
+        }
+        plans.push_back(plan);
+        return plan;
+    }
+
+private:
+    FftPlanCache(const FftPlanCache &);
+    FftPlanCache &operator=(const FftPlanCache &);
+
+    std::vector<FftPlan *> plans;
+};
+
+//Per-source input and output buffers for a shared plan
+class FftEngine
+{
+public:
+    FftEngine() : size(0), outputs(0), channels(0), input(NULL), output(NULL), plan(NULL) {}
+    ~FftEngine() { destroy(); }
+
+    //Fill input only after this returns
+    bool init(const FftPlan *sharedPlan) {
+        destroy();
+        plan = sharedPlan;
+        size = plan->size;
+        outputs = plan->outputs;
+        channels = plan->channels;
+        input = fftw_alloc_real(size * channels);
+        output = fftw_alloc_complex(outputs * channels);
+        return input != NULL && output != NULL;
+    }
+
+    void execute() { plan->execute(input, output); }
+
+    void destroy() {
+        fftw_free(input);
+        fftw_free(output);
+        input = NULL;
+        output = NULL;
+    }
+
+    int size;              //real samples per frame, per channel
+    int outputs;           //complex outputs per channel, size/2+1
+    int channels;
+    double *input;
+    fftw_complex *output;
+
+private:
+    FftEngine(const FftEngine &);
+    FftEngine &operator=(const FftEngine &);
+
+    const FftPlan *plan;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stddef.h>
+#include <math.h>
+
+#include "sample.h"
+
+//Idle detection. Each hop's peak is taken as it comes out of the ring, before
+//any analysis, and once a source has stayed below the threshold for the hold
+//time it goes idle: no FFT, binning or shaping, only a keep-alive message now
+//and then. The first hop over the threshold wakes it, and that same hop is
+//analysed, so nothing is missed. The sliding history is still fed while
+//idle, so the first frame after waking is whole.
+typedef struct
+{
+    double thresholdDb;        //peak in dBFS below which a hop counts as silent
+    double holdSeconds;        //silence before going idle, 0 to never go idle
+    double keepaliveSeconds;   //between messages while idle or dark, 0 for none
+}
+IdleConfig;
+
+inline void idleConfigDefaults(IdleConfig *config) {
+    config->thresholdDb = -70;
+    config->holdSeconds = 2;
+    config->keepaliveSeconds = 5;
+}
+
+//Largest magnitude of n converted samples
+inline float idlePeakScalar(const float *x, size_t n) {
+    float peak = 0;
+    for(size_t i=0; i<n; i++) {
+        float a = fabsf(x[i]);
+        peak = a > peak ? a : peak;
+    }
+    return peak;
+}
+
+#ifdef SAMPLE_X86
+inline float idlePeak(const float *x, size_t n) {
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 peak = _mm_setzero_ps();
+    size_t i = 0;
+    for(; i+4<=n; i+=4) {
+        peak = _mm_max_ps(peak, _mm_andnot_ps(sign, _mm_loadu_ps(x + i)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, peak);
+    float tail = idlePeakScalar(x + i, n - i);
+    for(int l=0; l<4; l++) {
+        tail = lanes[l] > tail ? lanes[l] : tail;
+    }
+    return tail;
+}
+#else
+inline float idlePeak(const float *x, size_t n) {
+    return idlePeakScalar(x, n);
+}
+#endif
+
+class IdleDetector
+{
+public:
+    IdleDetector() : threshold(0), holdHops(0), quietHops(0), idle(false) {}
+
+    void init(double hopSeconds, const IdleConfig &config) {
+        //Converted samples are in 16 bit units
+        threshold = (float) (32768 * pow(10, config.thresholdDb / 20));
+        holdHops = config.holdSeconds > 0 ? (long) ceil(config.holdSeconds / hopSeconds) : 0;
+        quietHops = 0;
+        idle = false;
+    }
+
+    //Look at one hop of converted samples. Returns true if the source is
+    //idle and the hop need not be analysed.
+    bool update(const float *samples, size_t n) {
+        if(holdHops == 0) {
+            return false;
+        }
+        if(idlePeak(samples, n) >= threshold) {
+            quietHops = 0;
+            idle = false;
+            return false;
+        }
+        if(quietHops < holdHops) {
+            quietHops++;
+        }
+        idle = quietHops == holdHops;
+        return idle;
+    }
+
+    bool idling() const { return idle; }
+
+private:
+    float threshold;           //peak, in 16 bit units
+    long holdHops;
+    long quietHops;            //consecutive silent hops, up to holdHops
+    bool idle;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+//Log-linear latency histogram in microseconds: four buckets per power of two,
+//so any percentile read back is within 25% of the true value, from 1 us to
+//over an hour in a fixed 128 counters. Not thread safe; one thread records
+//and reports.
+
+#define LATENCY_BUCKETS (128)
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() { reset(); }
+
+    void record(int64_t ns) {
+        uint64_t us = ns > 0 ? (uint64_t) ns / 1000 : 0;
+        int bucket = bucketOf(us);
+        counts[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+        total++;
+        if(ns > worst) {
+            worst = ns;
+        }
+    }
+
+    //Upper edge of the bucket holding the p'th percentile (0-100), in ns
+    int64_t percentile(double p) const {
+        uint64_t rank = (uint64_t) (total * p / 100);
+        uint64_t seen = 0;
+        for(int b=0; b<LATENCY_BUCKETS; b++) {
+            seen += counts[b];
+            if(seen > rank) {
+                int64_t edge = bucketEdge(b) * 1000;
+                return edge < worst ? edge : worst;
+            }
+        }
+        return worst;
+    }
+
+    uint64_t count() const { return total; }
+    int64_t max() const { return worst; }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        total = 0;
+        worst = 0;
+    }
+
+    //One line of percentiles in ms, nothing if empty
+    void print(const char *name) const {
+        if(total == 0) {
+            return;
+        }
+        printf("  %-24s p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms  (%lu)\n", name,
+            percentile(50) / 1e6, percentile(90) / 1e6, percentile(99) / 1e6, worst / 1e6, (unsigned long) total);
+    }
+
+private:
+    //0-3 us get a bucket each, then four per power of two
+    static int bucketOf(uint64_t us) {
+        if(us < 4) {
+            return (int) us;
+        }
+        int octave = 63 - __builtin_clzll(us);
+        return 4 + (octave - 2) * 4 + (int) ((us >> (octave - 2)) & 3);
+    }
+
+    //Smallest value in us above bucket b
+    static int64_t bucketEdge(int b) {
+        if(b < 4) {
+            return b + 1;
+        }
+        int octave = (b - 4) / 4 + 2;
+        int sub = (b - 4) % 4;
+        return (int64_t) (4 + sub + 1) << (octave - 2);
+    }
+
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    int64_t worst;
+};
+
+#endif
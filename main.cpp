@@ -10,34 +10,15 @@
 
 #include "libs/portaudio.h"
 
-#define NUM_CHANNELS (4)
-#define NUM_SECONDS (0.05)
-#define SAMPLE_RATE (8000)
-#define NUM_BINS (32)
-#define SMOOTH_FACTOR (0.8)
-/* Select sample format. */
-#if 0
-#define PA_SAMPLE_TYPE  paFloat32
-typedef float SAMPLE;
-#define SAMPLE_SILENCE  (0.0f)
-#define PRINTF_S_FORMAT "%.8f"
-#elif 1
-#define PA_SAMPLE_TYPE  paInt16
-typedef short SAMPLE;
-#define SAMPLE_SILENCE  (0)
-#define PRINTF_S_FORMAT "%d"
-#elif 0
-#define PA_SAMPLE_TYPE  paInt8
-typedef char SAMPLE;
-#define SAMPLE_SILENCE  (0)
-#define PRINTF_S_FORMAT "%d"
-#else
-#define PA_SAMPLE_TYPE  paUInt8
-typedef unsigned char SAMPLE;
-#define SAMPLE_SILENCE  (128)
-#define PRINTF_S_FORMAT "%d"
-#endif
-
+#include "sample.h"
+#include "fft.h"
+#include "wire.h"
+#include "publisher.h"
+#include "bench.h"
+#include "scheduler.h"
+#include "config.h"
+#include "pool.h"
+#include "source.h"
 
 void error(PaError err) {
     Pa_Terminate();
@@ -45,85 +26,49 @@ void error(PaError err) {
     fprintf( stderr, "Error message: %s\n", Pa_GetErrorText(err));
 }
 
-typedef struct
-{
-    int frameIndex;
-    int maxFrameIndex;
-    fftw_complex *recordedSamples;
-    fftw_complex *fftwOutput;
-}   
-paTestData;
 
-//Plan global
-fftw_plan p;
+int main(int argc, char* argv[]) {
 
-static int patestCallback( const void *inputBuffer, void *outputBuffer,
-                           unsigned long framesPerBuffer,
-                           const PaStreamCallbackTimeInfo* timeInfo,
-                           PaStreamCallbackFlags statusFlags,
-                           void *userData )
-{
-    paTestData *data = (paTestData*)userData;
-    const SAMPLE *rptr = (const SAMPLE*)inputBuffer;
-    fftw_complex *wptr = &data->recordedSamples[data->frameIndex * NUM_CHANNELS];
-    long framesToCalc;
-    long i;
-    int finished;
-    unsigned long framesLeft = data->maxFrameIndex - data->frameIndex;
-    
-    (void) outputBuffer; /* Prevent unused variable warnings. */
-    (void) timeInfo;
-    (void) statusFlags;
-    (void) userData;
-    
-    if( framesLeft < framesPerBuffer )
-    {
-        framesToCalc = framesLeft;
-        finished = paContinue;
+    Config config;
+    int parsed = configParse(&config, argc, argv);
+    if(parsed != 0) {
+        return parsed < 0 ? 0 : 1;
     }
-    else
-    {
-        framesToCalc = framesPerBuffer;
-        finished = paContinue;
+
+    if(config.bench) {
+        return benchBins(config.bins) || benchFilterbank(config.bins, config.sampleRate) || benchConvert(config.hop * config.inputChannels);
     }
-    
-    if( inputBuffer == NULL )
-    {
-        for( i=0; i<framesToCalc; i++ )
-        {
-            *wptr[0] = SAMPLE_SILENCE;  /* left */
-            wptr++;
-            if( NUM_CHANNELS == 2 ) {
-              *wptr[0] = SAMPLE_SILENCE;
-              wptr++;
-            }
-        }
+
+    if(config.benchCapture) {
+        return benchCapture(config);
     }
-    else
-    {
-        for( i=0; i<framesToCalc; i++ )
-        {
-            *wptr[0] = *rptr++;  /* left */
-            wptr++;
-            if( NUM_CHANNELS == 2 ) {
-              *wptr[0] = *rptr++;
-              wptr++;
-            }
+
+    if(config.listDevices) {
+        PaError err = Pa_Initialize();
+        if( err != paNoError) {
+            error(err);
+            return 1;
         }
+        listInputDevices();
+        Pa_Terminate();
+        return 0;
     }
-    data->frameIndex += framesToCalc;
-    return finished;
-}
-
-
-int main(int argc, char* argv[]) {
-
 
     printf("Starting connection to message broker...\n");
     amqp_socket_t *socket = NULL;
     amqp_connection_state_t conn;
     int status;
 
+    //amqp_parse_url points into the string it parses, so give it a copy that outlives the connection
+    char brokerUrl[sizeof(config.brokerUrl)];
+    struct amqp_connection_info broker;
+    memcpy(brokerUrl, config.brokerUrl, sizeof(brokerUrl));
+    amqp_default_connection_info(&broker);
+    if(amqp_parse_url(brokerUrl, &broker) != AMQP_STATUS_OK) {
+        printf("Invalid broker URL %s\n", config.brokerUrl);
+        return 1;
+    }
+
     conn = amqp_new_connection();
 
     socket = amqp_tcp_socket_new(conn);
@@ -132,14 +77,14 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    status = amqp_socket_open(socket, "localhost", 5672);
+    status = amqp_socket_open(socket, broker.host, broker.port);
 
     if(status) {
         printf("Failed opening SSL/TLS connection\n");
         return 1;
     }
 
-    amqp_login(conn, "/", 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, "guest", "guest");
+    amqp_login(conn, broker.vhost, 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, broker.user, broker.password);
     amqp_channel_open(conn, 1);
     amqp_get_rpc_reply(conn);
     
@@ -156,173 +101,112 @@ int main(int argc, char* argv[]) {
 
     printf( "PortAudio version: 0x%08X\n", Pa_GetVersion());
 
-    PaStreamParameters  inputParameters;
-    paTestData          data;
-    int                 i;
-    int                 totalFrames;
-    int                 numSamples;
-    int                 numBytes;
-
     printf("patest_record.c\n"); fflush(stdout);
 
-    data.maxFrameIndex = totalFrames = NUM_SECONDS * SAMPLE_RATE; /* Record for a few seconds. */
-    data.frameIndex = 0;
-    numSamples = totalFrames * NUM_CHANNELS;
-    numBytes = numSamples * sizeof(fftw_complex);
-    data.recordedSamples = (fftw_complex *) fftw_malloc( numBytes ); /* From now on, recordedSamples is initialised. */
-    data.fftwOutput = (fftw_complex *) fftw_malloc( numBytes );
-    if( data.recordedSamples == NULL )
-    {
-        printf("Could not allocate record array.\n");
-        error(err);
-        return 1;
+    //Sources with the same frame shape share one fft plan; each has its own
+    //buffers, analysis state and routing key but they all publish through one
+    //connection and are analysed on one pool of workers
+    int sourceCount = config.sourceCount;
+    int maxChannels = 0;
+    FftPlanCache plans;
+    Publisher publisher;
+    //Static so the cache line aligned rings keep their alignment
+    static Source sources[MAX_SOURCES];
+    printf("Generating fft plans. May take some time...\n");
+    for(int i=0; i<sourceCount; i++) {
+        if( !sources[i].init(i, config.sources[i], config, &plans, &publisher) )
+        {
+            printf("Could not set up %s.\n", sources[i].name);
+            error(err);
+            return 1;
+        }
+        if(config.sources[i].channels > maxChannels) {
+            maxChannels = config.sources[i].channels;
+        }
+    }
+    printf("Plans generated.\n");
+    printf("Binning with the %s kernel.\n", sources[0].analyser.binMap.kernelName);
+
+    for(int i=0; i<sourceCount; i++) {
+        err = sources[i].open(config);
+        if( err != paNoError) {
+            error(err);
+            return 1;
+        }
     }
-    for( i=0; i<numSamples; i++ ) data.recordedSamples[i][0] = 0;
-
-    //Before we begin gathering sound data, create an fftw plan
-    printf("Generating fft plan. May take some time...\n");
-    p = fftw_plan_dft_1d(numSamples, data.recordedSamples, data.fftwOutput, FFTW_FORWARD, FFTW_MEASURE);
-    printf("Plan generated.\n");
-
-
-    inputParameters.device = Pa_GetDefaultInputDevice();
-    inputParameters.channelCount = 2;                    /* stereo input */
-    inputParameters.sampleFormat = PA_SAMPLE_TYPE;
-    inputParameters.suggestedLatency = Pa_GetDeviceInfo( inputParameters.device )->defaultLowInputLatency;
-    inputParameters.hostApiSpecificStreamInfo = NULL;
-
 
-    PaStream *stream;
-    /* Open an audio I/O stream. */
-    err = Pa_OpenStream( &stream,
-                                &inputParameters,
-                                NULL,
-                                SAMPLE_RATE,
-                                256,
-                                paClipOff,
-                                patestCallback,
-                                &data ); /*This is a pointer that will be passed to
-                                                   your callback*/
-    if( err != paNoError) {
+    if( !publisher.start(conn, 1, config.publisher, config.bins, maxChannels) )
+    {
+        printf("Could not start publisher.\n");
         error(err);
         return 1;
     }
 
-    err = Pa_StartStream( stream );
-
-    double sum[NUM_BINS];
+    WorkerPool pool;
+    pool.start(config.workers);
+    printf("Analysing %d sources on %d workers.\n", sourceCount, pool.size());
 
     printf("Reading audio and sending results to message broker...\n");
+    //Hand a source to the workers as soon as its callback has delivered a hop,
+    //or when its publish deadline passes. A source that is already with the
+    //workers re-checks both itself before letting go, so while it is busy its
+    //deadline only bounds how long the dispatcher sleeps.
+    FrameSignal **signals = new FrameSignal*[sourceCount];
+    struct pollfd *fds = new struct pollfd[sourceCount];
+    bool *ready = new bool[sourceCount];
+    for(int i=0; i<sourceCount; i++) {
+        signals[i] = &sources[i].signal;
+    }
+    //Runs until every source is a file replayed to the end
     while(1){
-        data.frameIndex = 0;
-        for(i=0;i<NUM_BINS;i++){
-            sum[i] = 0;
+        bool done = true;
+        for(int i=0; i<sourceCount; i++) {
+            done = done && sources[i].done();
         }
-        Pa_Sleep(1000*NUM_SECONDS);
-        fftw_execute(p);
-        for(i=1;i<totalFrames; i++) {
-            //downsample to amount of LEDs
-            int index = (int) floor(i*(float)NUM_BINS/(float)totalFrames);
-            //Log10 to tretch the results to better fit human hearing
-            sum[index] += log10(data.fftwOutput[i][0]*data.fftwOutput[i][0] + data.fftwOutput[i][1]*data.fftwOutput[i][1]);
+        if(done) {
+            printf("Every file has been replayed.\n");
+            break;
         }
-
-        //Add some white noise to drown out background noises
-        for(i=0; i<NUM_BINS; i++){
-            if(sum[i]) {
-              sum[i] += 50;
+        int64_t now = monotonicNow();
+        int64_t deadline = INT64_MAX;
+        for(int i=0; i<sourceCount; i++) {
+            int64_t due = sources[i].deadline();
+            if(due <= now && sources[i].scheduled.load(std::memory_order_acquire)) {
+                due = now + 1000000;
             }
-        }
-
-        //Remove any invalid values
-        for(i=0; i<NUM_BINS; i++) {
-            //Case for where sum is zero, log returns -inf
-            if(isinf(sum[i])) {
-              sum[i] = 0.0;
+            if(due < deadline) {
+                deadline = due;
             }
         }
-
-        //Scale the results to the range 0-1
-        float max = 0, min = 100000;
-        for(i=0; i<NUM_BINS; i++) {
-          if(sum[i] > max) {
-            max = sum[i];
-          }
-          if(sum[i] < min) {
-            min = sum[i];
-          }
-        }
-
-        for(i=0; i< NUM_BINS; i++) {
-          //Case for where the max is the min is zero
-          if(max == 0) {
-            sum[i] = 0;
-          } else {
-            sum[i] = ((float) abs(sum[i] - min)) / abs(max - min);
-          }
-        }
-
-        //Square results so bright is brighter and dim is dimmer
-        for(i=0; i< NUM_BINS; i++) {
-          sum[i] = sum[i] * sum[i];
-        }
-
-        //Smooth the results
-        for(i=1; i<NUM_BINS; i++) {
-          sum[i] = SMOOTH_FACTOR * sum[i] + (1 - SMOOTH_FACTOR) * sum[i-1];
+        waitAny(signals, fds, ready, sourceCount, deadline);
+        now = monotonicNow();
+        for(int i=0; i<sourceCount; i++) {
+            if(ready[i] || now >= sources[i].deadline()) {
+                sources[i].schedule(&pool);
+            }
         }
-
-
-        //Give enough space for all numbers plus commas
-        char* messagebody = (char*) malloc(16*sizeof(char)*(NUM_BINS));
-        memset(messagebody, 0, 16*NUM_BINS);
-        char currentbin[16];
-        memset(currentbin, 0, 16);
-        //Build message by concatenating strings
-        for(int i=0;i<NUM_BINS-1;i++){
-            snprintf(currentbin, 16, "%f,", sum[i]);
-            messagebody = strcat(messagebody, currentbin);
+        pool.report(now);
+        for(int i=0; i<sourceCount; i++) {
+            sources[i].checkWatchdog(now, config.watchdog);
+            sources[i].reportCapture(now);
         }
-        snprintf(currentbin, 16, "%f", sum[NUM_BINS-1]);
-        messagebody = strcat(messagebody, currentbin);
-
-        amqp_basic_properties_t props;
-        props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_DELIVERY_MODE_FLAG;
-        props.content_type = amqp_cstring_bytes("text/plain");
-        props.delivery_mode = 2; /* persistent delivery mode */
-
-        amqp_basic_publish(conn,
-            1,
-            amqp_cstring_bytes(""),
-            amqp_cstring_bytes("primary-queue"),
-            0,
-            0,
-            &props,
-            amqp_cstring_bytes(messagebody));
     }
 
-    //Terminate amqp connection
+    //Let the workers finish, then terminate amqp connection once the
+    //publisher has flushed its queue
+    pool.stop();
+    publisher.stop();
     amqp_channel_close(conn, 1, AMQP_REPLY_SUCCESS);
     amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
     amqp_destroy_connection(conn);
 
     //End portaudio bindings
-
-    err = Pa_StopStream( stream );
-    if( err != paNoError) {
-        error(err);
-        return 1;
-    }
-
-    err = Pa_CloseStream( stream );
-    if( err != paNoError) {
-        error(err);
-        return 1;
+    for(int i=0; i<sourceCount; i++) {
+        sources[i].close();
     }
-
-    //Once stopped and closed, destroy plan
-    fftw_destroy_plan(p);
-
+    delete[] signals;
+    delete[] fds;
+    delete[] ready;
 
     err = Pa_Terminate();
     if( err != paNoError) {
@@ -0,0 +1,154 @@
+#ifndef NOISEGATE_H
+#define NOISEGATE_H
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "bins.h"
+
+//Noise floor tracking by minimum statistics, and a spectral gate on top of
+//it. The floor of a bin is the lowest level it has had over the last window,
+//on the assumption that any bin drops to the background noise now and then
+//even while music plays. The minimum over the window is kept as the minima
+//of NOISE_GATE_SUBWINDOWS sub-windows, so each hop costs O(1) per bin plus
+//an O(NOISE_GATE_SUBWINDOWS) rescan once per sub-window. The gate then
+//subtracts the floor plus a margin in place, leaving how far each bin stands
+//above the noise and zero for bins that do not clear it.
+//
+//Music held steady for longer than the window becomes the floor and is
+//gated, so the window should be longer than the longest sustained note.
+
+#define NOISE_GATE_SUBWINDOWS (8)
+
+typedef struct
+{
+    double windowSeconds;      //how far back the floor looks, 0 to turn the gate off
+    double marginDb;           //how far above the floor a bin must be to pass
+}
+NoiseGateConfig;
+
+inline void noiseGateConfigDefaults(NoiseGateConfig *config) {
+    config->windowSeconds = 5;
+    config->marginDb = 6;
+}
+
+//Floor state for every bin of every channel. Only one thread may use it at a time.
+class NoiseGate
+{
+public:
+    NoiseGate() : bins(0), channels(0), subwindowHops(0), enabled(false), current(NULL), minima(NULL), windowMin(NULL),
+        margin(NULL), filled(NULL), slot(NULL) {}
+    ~NoiseGate() {
+        free(current);
+        free(minima);
+        free(windowMin);
+        free(margin);
+        free(filled);
+        free(slot);
+    }
+
+    bool init(const BinMap *map, int binCount, int channelCount, double hopSeconds, const NoiseGateConfig &config) {
+        bins = binCount;
+        channels = channelCount;
+        enabled = config.windowSeconds > 0;
+        subwindowHops = (int) ceil(config.windowSeconds / hopSeconds / NOISE_GATE_SUBWINDOWS);
+        if(subwindowHops < 1) {
+            subwindowHops = 1;
+        }
+        size_t count = (size_t) bins * channels;
+        free(current);
+        free(minima);
+        free(windowMin);
+        free(margin);
+        free(filled);
+        free(slot);
+        current = (double *) malloc(count * sizeof(double));
+        minima = (double *) malloc(count * NOISE_GATE_SUBWINDOWS * sizeof(double));
+        windowMin = (double *) malloc(count * sizeof(double));
+        margin = (double *) malloc(bins * sizeof(double));
+        filled = (int *) calloc(channels, sizeof(int));
+        slot = (int *) calloc(channels, sizeof(int));
+        if(current == NULL || minima == NULL || windowMin == NULL || margin == NULL || filled == NULL || slot == NULL) {
+            return false;
+        }
+        for(size_t i=0; i<count; i++) {
+            current[i] = INFINITY;
+            windowMin[i] = INFINITY;
+        }
+        for(size_t i=0; i<count * NOISE_GATE_SUBWINDOWS; i++) {
+            minima[i] = INFINITY;
+        }
+        for(int b=0; b<bins; b++) {
+            margin[b] = config.marginDb / 10 * binMapUnits(map, b);
+        }
+        return true;
+    }
+
+    //Learn from one channel's summed log power, then replace each bin with
+    //how far it is above the floor plus the margin, or zero. Bins with no
+    //power (-inf) are zero and not learned from. Returns true if any bin passed.
+    bool apply(double *sum, int channel) {
+        if(!enabled) {
+            return true;
+        }
+        double *low = current + channel * bins;
+        double *window = windowMin + channel * bins;
+        bool open = false;
+        for(int i=0; i<bins; i++) {
+            double x = sum[i];
+            if(isinf(x)) {
+                sum[i] = 0;
+                continue;
+            }
+            if(x < low[i]) {
+                low[i] = x;
+            }
+            double floor = low[i] < window[i] ? low[i] : window[i];
+            double above = x - floor - margin[i];
+            sum[i] = above > 0 ? above : 0;
+            open = open || above > 0;
+        }
+        if(++filled[channel] == subwindowHops) {
+            rotate(channel);
+        }
+        return open;
+    }
+
+private:
+    NoiseGate(const NoiseGate &);
+    NoiseGate &operator=(const NoiseGate &);
+
+    //Close the current sub-window: it replaces the oldest, and the window
+    //minimum is rescanned from the sub-window minima
+    void rotate(int channel) {
+        int s = slot[channel];
+        for(int i=0; i<bins; i++) {
+            size_t n = (size_t) channel * bins + i;
+            double *subwindows = minima + n * NOISE_GATE_SUBWINDOWS;
+            subwindows[s] = current[n];
+            current[n] = INFINITY;
+            double lowest = INFINITY;
+            for(int w=0; w<NOISE_GATE_SUBWINDOWS; w++) {
+                if(subwindows[w] < lowest) {
+                    lowest = subwindows[w];
+                }
+            }
+            windowMin[n] = lowest;
+        }
+        slot[channel] = (s + 1) % NOISE_GATE_SUBWINDOWS;
+        filled[channel] = 0;
+    }
+
+    int bins;
+    int channels;
+    int subwindowHops;
+    bool enabled;
+    double *current;           //per bin per channel, minimum so far in the open sub-window
+    double *minima;            //NOISE_GATE_SUBWINDOWS closed sub-window minima per bin per channel
+    double *windowMin;         //minimum of those
+    double *margin;            //per bin, marginDb in the bin's units
+    int *filled;               //per channel, hops in the open sub-window
+    int *slot;                 //per channel, the sub-window the open one replaces
+};
+
+#endif
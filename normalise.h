@@ -0,0 +1,113 @@
+#ifndef NORMALISE_H
+#define NORMALISE_H
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "bins.h"
+
+//Adaptive gain: each bin is scaled between a floor and a ceiling it has
+//learned from its own history, rather than between the min and max of the
+//current frame. Both follow the bin with a fast one pole rate when it goes
+//past them and a slow one when it falls back inside, so a hit is caught at
+//once but the range only narrows over seconds, and quiet passages stay
+//quiet instead of being stretched to full brightness. The span is never
+//allowed below a minimum, so a bin holding steady does not blow noise up
+//to full scale. O(1) per bin per hop, no sorting and no history kept.
+typedef struct
+{
+    double attackMs;           //time constant for the floor or ceiling to reach a new extreme
+    double releaseSeconds;     //time constant for them to close back in on the bin
+    double rangeDb;            //smallest span between floor and ceiling
+}
+NormaliserConfig;
+
+inline void normaliserConfigDefaults(NormaliserConfig *config) {
+    config->attackMs = 100;
+    config->releaseSeconds = 10;
+    config->rangeDb = 20;
+}
+
+//Floor and ceiling for every bin of every channel. Only one thread may use
+//it at a time.
+class BinNormaliser
+{
+public:
+    BinNormaliser() : bins(0), channels(0), attack(0), release(0), floor(NULL), ceiling(NULL), minRange(NULL),
+        primed(NULL) {}
+    ~BinNormaliser() {
+        free(floor);
+        free(ceiling);
+        free(minRange);
+        free(primed);
+    }
+
+    //map says how far each bin moves for 10 dB, which scales the minimum span
+    bool init(const BinMap *map, int binCount, int channelCount, double hopSeconds, const NormaliserConfig &config) {
+        bins = binCount;
+        channels = channelCount;
+        attack = config.attackMs > 0 ? 1 - exp(-hopSeconds * 1000 / config.attackMs) : 1;
+        release = 1 - exp(-hopSeconds / config.releaseSeconds);
+        free(floor);
+        free(ceiling);
+        free(minRange);
+        free(primed);
+        floor = (double *) calloc(bins * channels, sizeof(double));
+        ceiling = (double *) calloc(bins * channels, sizeof(double));
+        minRange = (double *) calloc(bins, sizeof(double));
+        primed = (bool *) calloc(bins * channels, sizeof(bool));
+        if(floor == NULL || ceiling == NULL || minRange == NULL || primed == NULL) {
+            return false;
+        }
+        for(int b=0; b<bins; b++) {
+            minRange[b] = config.rangeDb / 10 * binMapUnits(map, b);
+            if(minRange[b] <= 0) {
+                minRange[b] = config.rangeDb / 10;
+            }
+        }
+        return true;
+    }
+
+    //Scale one channel's bins to 0-1 in place, learning from them as it
+    //goes. Zero marks a bin with no power at all, which stays zero and is
+    //not learned from.
+    void apply(double *sum, int channel) {
+        double *low = floor + channel * bins;
+        double *high = ceiling + channel * bins;
+        bool *seen = primed + channel * bins;
+        for(int i=0; i<bins; i++) {
+            double x = sum[i];
+            if(x == 0) {
+                continue;
+            }
+            if(!seen[i]) {
+                low[i] = x - minRange[i];
+                high[i] = x;
+                seen[i] = true;
+            }
+            high[i] += (x > high[i] ? attack : release) * (x - high[i]);
+            low[i] += (x < low[i] ? attack : release) * (x - low[i]);
+            double span = high[i] - low[i];
+            if(span < minRange[i]) {
+                span = minRange[i];
+            }
+            double level = (x - low[i]) / span;
+            sum[i] = level < 0 ? 0 : level > 1 ? 1 : level;
+        }
+    }
+
+private:
+    BinNormaliser(const BinNormaliser &);
+    BinNormaliser &operator=(const BinNormaliser &);
+
+    int bins;
+    int channels;
+    double attack;             //share of the gap closed per hop when the bin is outside the range
+    double release;            //and when it is inside
+    double *floor;             //per bin per channel, in summed log10 power
+    double *ceiling;
+    double *minRange;          //per bin, rangeDb in the bin's units
+    bool *primed;              //the bin has had power since start
+};
+
+#endif
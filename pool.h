@@ -0,0 +1,184 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ringbuffer.h"
+#include "scheduler.h"
+
+typedef struct
+{
+    void (*run)(void *arg);
+    void *arg;
+}
+Task;
+
+//Work-stealing pool of analysis threads shared by every source.
+//Each worker has its own deque. A task goes to the deque of the worker its
+//hint names, so a source normally stays on one core with its state in that
+//core's cache. A worker runs its own tasks oldest first, and when it has
+//none it steals the newest task from another worker before going to sleep.
+//The pool does not order tasks; callers that need ordering must keep at most
+//one task per stream in flight, as Source does.
+class WorkerPool
+{
+public:
+    WorkerPool() : pending(0), stopping(false), windowStart(0) {}
+    ~WorkerPool() { stop(); }
+
+    //Start count workers, or one per core if count is 0
+    void start(int count) {
+        if(count <= 0) {
+            count = std::thread::hardware_concurrency();
+        }
+        if(count <= 0) {
+            count = 1;
+        }
+        windowStart = monotonicNow();
+        for(int i=0; i<count; i++) {
+            workers.push_back(new Worker());
+        }
+        for(int i=0; i<count; i++) {
+            workers[i]->thread = std::thread(&WorkerPool::work, this, i);
+        }
+    }
+
+    int size() const { return (int) workers.size(); }
+
+    //Queue task on the worker hint picks, modulo the pool size
+    void submit(Task task, unsigned hint) {
+        Worker *worker = workers[hint % workers.size()];
+        {
+            std::lock_guard<std::mutex> guard(worker->lock);
+            worker->tasks.push_back(task);
+        }
+        //Counted under the sleep lock so a worker about to sleep cannot miss it
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            pending++;
+        }
+        wake.notify_one();
+    }
+
+    //Finish the queued tasks and join the workers
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(size_t i=0; i<workers.size(); i++) {
+            workers[i]->thread.join();
+            delete workers[i];
+        }
+        workers.clear();
+    }
+
+    //Print each worker's share of wall time spent running tasks, every
+    //SCHEDULER_REPORT_SECONDS. Call from one thread only.
+    void report(int64_t now) {
+        int64_t elapsed = now - windowStart;
+        if(workers.empty() || elapsed < SCHEDULER_REPORT_SECONDS * 1000000000LL) {
+            return;
+        }
+        for(size_t i=0; i<workers.size(); i++) {
+            Worker *worker = workers[i];
+            int64_t busy = worker->busyNs.exchange(0, std::memory_order_relaxed);
+            unsigned long tasks = worker->ran.exchange(0, std::memory_order_relaxed);
+            unsigned long stolen = worker->stolen.exchange(0, std::memory_order_relaxed);
+            printf("Worker %lu: %.1f%% busy, %lu tasks, %lu stolen\n",
+                (unsigned long) i, 100.0 * busy / elapsed, tasks, stolen);
+        }
+        windowStart = now;
+    }
+
+private:
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+
+    struct Worker
+    {
+        Worker() : busyNs(0), ran(0), stolen(0) {}
+
+        std::mutex lock;
+        std::deque<Task> tasks;
+        std::thread thread;
+        std::atomic<int64_t> busyNs;          //since the last report
+        std::atomic<unsigned long> ran;
+        std::atomic<unsigned long> stolen;
+        char pad[CACHE_LINE_SIZE];            //keep neighbouring workers' counters apart
+    };
+
+    bool takeOwn(Worker *worker, Task *task) {
+        std::lock_guard<std::mutex> guard(worker->lock);
+        if(worker->tasks.empty()) {
+            return false;
+        }
+        *task = worker->tasks.front();
+        worker->tasks.pop_front();
+        return true;
+    }
+
+    bool steal(int thief, Task *task) {
+        int count = (int) workers.size();
+        for(int i=1; i<count; i++) {
+            Worker *victim = workers[(thief + i) % count];
+            std::lock_guard<std::mutex> guard(victim->lock);
+            if(!victim->tasks.empty()) {
+                *task = victim->tasks.back();
+                victim->tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int index) {
+        Worker *self = workers[index];
+        while(1) {
+            Task task;
+            bool stole = false;
+            if(!takeOwn(self, &task)) {
+                stole = steal(index, &task);
+                if(!stole) {
+                    std::unique_lock<std::mutex> guard(sleepLock);
+                    while(pending <= 0 && !stopping) {
+                        wake.wait(guard);
+                    }
+                    if(pending <= 0) {
+                        return;
+                    }
+                    continue;
+                }
+            }
+            {
+                std::lock_guard<std::mutex> guard(sleepLock);
+                pending--;
+            }
+            int64_t started = monotonicNow();
+            task.run(task.arg);
+            self->busyNs.fetch_add(monotonicNow() - started, std::memory_order_relaxed);
+            self->ran.fetch_add(1, std::memory_order_relaxed);
+            if(stole) {
+                self->stolen.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::vector<Worker *> workers;
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    long pending;                             //queued tasks across all workers, under sleepLock.
+                                              //Briefly -1 when a task is taken before submit counts it.
+    bool stopping;
+    int64_t windowStart;
+};
+
+#endif
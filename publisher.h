@@ -0,0 +1,432 @@
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "ringbuffer.h"
+#include "scheduler.h"
+#include "latency.h"
+#include "wire.h"
+
+//Seconds between reports of dropped or failed publishes
+#define PUBLISHER_REPORT_SECONDS (10)
+
+//What publish() does when the I/O thread has fallen a whole queue behind
+enum OverflowPolicy
+{
+    OVERFLOW_DROP_OLDEST = 0,  //discard the stalest queued frame, a late spectrum is worthless
+    OVERFLOW_DROP_NEWEST = 1,  //discard the frame being published
+    OVERFLOW_BLOCK = 2         //wait for the I/O thread, stalling analysis
+};
+
+//How spectra are handed to the broker.
+//Spectra go stale in 50 ms, so the default is transient delivery without confirms.
+//Persistent delivery makes the broker write every frame to disk; confirms make
+//the broker ack each publish, with at most confirmWindow left unacknowledged
+//before the I/O thread waits for acks.
+typedef struct
+{
+    char routingKey[256];      //used by sources that do not set their own
+    size_t queueDepth;
+    OverflowPolicy overflow;
+    uint8_t deliveryMode;      //AMQP_DELIVERY_NONPERSISTENT or AMQP_DELIVERY_PERSISTENT
+    bool confirms;
+    int confirmWindow;
+}
+PublisherConfig;
+
+inline void publisherConfigDefaults(PublisherConfig *config) {
+    snprintf(config->routingKey, sizeof(config->routingKey), "%s", "primary-queue");
+    config->queueDepth = 16;
+    config->overflow = OVERFLOW_DROP_OLDEST;
+    config->deliveryMode = AMQP_DELIVERY_NONPERSISTENT;
+    config->confirms = false;
+    config->confirmWindow = 64;
+}
+
+//Seconds the I/O thread waits for an ack with a full confirm window before giving up on the window
+#define PUBLISHER_CONFIRM_TIMEOUT (1)
+
+//Timing and capture health sent in each message's headers. The counts are
+//totals since the source started, so a consumer can difference any two messages.
+//Times are of the newest sample in the spectrum.
+typedef struct
+{
+    uint64_t sequence;         //x-sequence: per source, one more for every frame published
+    double adcTime;            //x-adc-time: portaudio stream time the sample was captured, seconds
+    int64_t adcNs;             //x-adc-ns: the same on CLOCK_MONOTONIC, ns
+    int64_t analysedNs;        //x-analysed-ns: CLOCK_MONOTONIC ns its FFT and binning finished
+    uint64_t overflows;        //x-input-overflows: blocks portaudio flagged paInputOverflow
+    uint64_t underflows;       //x-input-underflows: blocks flagged paInputUnderflow
+    uint64_t truncated;        //x-truncated-blocks: blocks cut short by a full ring
+    uint64_t partial;          //x-partial-blocks: callbacks with fewer frames than frames-per-buffer
+    uint64_t silent;           //x-silent-blocks: callbacks without input, queued as silence
+    uint64_t dropped;          //x-dropped-samples: samples lost to truncation
+    uint64_t idle;             //x-idle: 1 if the source is idle and this is a keep-alive
+}
+FrameInfo;
+
+#define PUBLISHER_MAX_HEADERS (16)
+
+typedef struct
+{
+    WireBuffer body;
+    WireFormat format;
+    const char *routingKey;    //owned by the source, which outlives the publisher
+    bool hasInfo;
+    FrameInfo info;
+}
+PublishFrame;
+
+inline void publisherHeaderTime(amqp_table_entry_t *entries, int *count, const char *key, double seconds) {
+    amqp_table_entry_t *entry = &entries[(*count)++];
+    entry->key = amqp_cstring_bytes(key);
+    entry->value.kind = AMQP_FIELD_KIND_F64;
+    entry->value.value.f64 = seconds;
+}
+
+inline void publisherHeader(amqp_table_entry_t *entries, int *count, const char *key, uint64_t value) {
+    amqp_table_entry_t *entry = &entries[(*count)++];
+    entry->key = amqp_cstring_bytes(key);
+    entry->value.kind = AMQP_FIELD_KIND_I64;
+    entry->value.value.i64 = (int64_t) value;
+}
+
+//Publishes spectra to the broker from a dedicated I/O thread.
+//The analysis loop encodes each frame straight into a preallocated queue slot
+//and returns, so broker stalls and TCP backpressure never delay the next
+//capture cycle. Once started, the connection belongs to the I/O thread, and
+//every source shares it, each publishing under its own routing key.
+//publish() may be called from any number of threads.
+class Publisher
+{
+public:
+    Publisher() : published(0), droppedOldest(0), droppedNewest(0), blocked(0), failed(0),
+        confirmed(0), nacked(0), confirmWaits(0), conn(NULL), channel(0), running(false), stopping(false),
+        unconfirmed(NULL), nextTag(1), oldestTag(1) {
+        publisherConfigDefaults(&config);
+    }
+    ~Publisher() { stop(); }
+
+    //Preallocate queueDepth frames of up to bins*channels values and start the I/O thread
+    bool start(amqp_connection_state_t connection, amqp_channel_t amqpChannel,
+               const PublisherConfig &publisherConfig, int bins, int channels) {
+        config = publisherConfig;
+        conn = connection;
+        channel = amqpChannel;
+        if(!queue.init(config.queueDepth)) {
+            return false;
+        }
+        for(size_t i=0; i<queue.size(); i++) {
+            if(!wireBufferInit(&queue.at(i).body, bins, channels)) {
+                return false;
+            }
+        }
+        if(sem_init(&ready, 0, 0) != 0) {
+            return false;
+        }
+        if(config.confirms) {
+            unconfirmed = new (std::nothrow) bool[config.confirmWindow]();
+            if(unconfirmed == NULL) {
+                return false;
+            }
+            amqp_confirm_select(conn, channel);
+            if(amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
+                fprintf(stderr, "Broker refused publisher confirms\n");
+                return false;
+            }
+        }
+        stopping.store(false);
+        running = true;
+        worker = std::thread(&Publisher::run, this);
+        return true;
+    }
+
+    //Encode values into the next free slot and hand it to the I/O thread, with
+    //info in the message headers unless it is NULL.
+    //Returns false if the frame was dropped: always under OVERFLOW_DROP_NEWEST,
+    //and under OVERFLOW_DROP_OLDEST when the only queued frame left is the one
+    //the I/O thread is sending, which may be held up for as long as the broker stalls.
+    bool publish(const double *values, int bins, int channels, WireFormat format, const char *routingKey,
+                 const FrameInfo *info) {
+        size_t ticket;
+        PublishFrame *frame = queue.claimPush(&ticket);
+        while(frame == NULL) {
+            if(config.overflow == OVERFLOW_DROP_NEWEST) {
+                droppedNewest.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if(config.overflow == OVERFLOW_DROP_OLDEST) {
+                size_t oldest;
+                if(queue.claimPop(&oldest) == NULL) {
+                    droppedNewest.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                queue.commitPop(oldest);
+                droppedOldest.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                blocked.fetch_add(1, std::memory_order_relaxed);
+                usleep(500);
+            }
+            frame = queue.claimPush(&ticket);
+        }
+        wireEncode(&frame->body, format, values, bins, channels);
+        frame->format = format;
+        frame->routingKey = routingKey;
+        frame->hasInfo = info != NULL;
+        if(info != NULL) {
+            frame->info = *info;
+        }
+        queue.commitPush(ticket);
+        sem_post(&ready);
+        return true;
+    }
+
+    //Send whatever is still queued, then stop the I/O thread
+    void stop() {
+        if(!running) {
+            return;
+        }
+        stopping.store(true);
+        sem_post(&ready);
+        worker.join();
+        sem_destroy(&ready);
+        for(size_t i=0; i<queue.size(); i++) {
+            wireBufferFree(&queue.at(i).body);
+        }
+        delete[] unconfirmed;
+        unconfirmed = NULL;
+        running = false;
+    }
+
+    std::atomic<unsigned long> published;
+    std::atomic<unsigned long> droppedOldest;
+    std::atomic<unsigned long> droppedNewest;
+    std::atomic<unsigned long> blocked;
+    std::atomic<unsigned long> failed;
+    std::atomic<unsigned long> confirmed;     //acked by the broker, confirm mode only
+    std::atomic<unsigned long> nacked;        //nacked, or never acked before the window timed out
+    std::atomic<unsigned long> confirmWaits;  //times the I/O thread stalled on a full confirm window
+
+private:
+    Publisher(const Publisher &);
+    Publisher &operator=(const Publisher &);
+
+    void run() {
+        std::chrono::steady_clock::time_point lastReport = std::chrono::steady_clock::now();
+        unsigned long lastLost = 0;
+        while(1) {
+            while(sem_wait(&ready) != 0 && errno == EINTR) {
+            }
+
+            size_t ticket;
+            PublishFrame *frame;
+            while((frame = queue.claimPop(&ticket)) != NULL) {
+                send(frame);
+                queue.commitPop(ticket);
+            }
+            if(stopping.load()) {
+                if(config.confirms) {
+                    awaitConfirms(0);
+                }
+                break;
+            }
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if(now - lastReport >= std::chrono::seconds(PUBLISHER_REPORT_SECONDS)) {
+                reportLatency();
+                unsigned long lost = droppedOldest + droppedNewest + failed + nacked;
+                if(lost != lastLost) {
+                    fprintf(stderr, "Publisher: %lu sent, %lu dropped oldest, %lu dropped newest, %lu blocked, %lu failed, %lu confirmed, %lu nacked, %lu window stalls\n",
+                        published.load(), droppedOldest.load(), droppedNewest.load(), blocked.load(), failed.load(),
+                        confirmed.load(), nacked.load(), confirmWaits.load());
+                    lastLost = lost;
+                }
+                lastReport = now;
+            }
+        }
+    }
+
+    void send(PublishFrame *frame) {
+        if(config.confirms && nextTag - oldestTag >= (uint64_t) config.confirmWindow) {
+            confirmWaits.fetch_add(1, std::memory_order_relaxed);
+            awaitConfirms(config.confirmWindow - 1);
+        }
+
+        amqp_basic_properties_t props;
+        props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_DELIVERY_MODE_FLAG;
+        props.content_type = amqp_cstring_bytes(wireContentType(frame->format));
+        props.delivery_mode = config.deliveryMode;
+
+        amqp_table_entry_t headers[PUBLISHER_MAX_HEADERS];
+        int headerCount = 0;
+        if(frame->hasInfo) {
+            publisherHeader(headers, &headerCount, "x-sequence", frame->info.sequence);
+            publisherHeaderTime(headers, &headerCount, "x-adc-time", frame->info.adcTime);
+            publisherHeader(headers, &headerCount, "x-adc-ns", frame->info.adcNs);
+            publisherHeader(headers, &headerCount, "x-analysed-ns", frame->info.analysedNs);
+            publisherHeader(headers, &headerCount, "x-input-overflows", frame->info.overflows);
+            publisherHeader(headers, &headerCount, "x-input-underflows", frame->info.underflows);
+            publisherHeader(headers, &headerCount, "x-truncated-blocks", frame->info.truncated);
+            publisherHeader(headers, &headerCount, "x-partial-blocks", frame->info.partial);
+            publisherHeader(headers, &headerCount, "x-silent-blocks", frame->info.silent);
+            publisherHeader(headers, &headerCount, "x-dropped-samples", frame->info.dropped);
+            publisherHeader(headers, &headerCount, "x-idle", frame->info.idle);
+            props._flags |= AMQP_BASIC_HEADERS_FLAG;
+            props.headers.num_entries = headerCount;
+            props.headers.entries = headers;
+            //Whole seconds of wall clock capture time, for consumers on other hosts
+            props._flags |= AMQP_BASIC_TIMESTAMP_FLAG;
+            props.timestamp = (uint64_t) ((frame->info.adcNs + realtimeOffset()) / 1000000000LL);
+        }
+
+        amqp_bytes_t body;
+        body.len = frame->body.length;
+        body.bytes = frame->body.data;
+
+        int status = amqp_basic_publish(conn,
+            channel,
+            amqp_cstring_bytes(""),
+            amqp_cstring_bytes(frame->routingKey),
+            0,
+            0,
+            &props,
+            body);
+        if(status != AMQP_STATUS_OK) {
+            failed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        published.fetch_add(1, std::memory_order_relaxed);
+        if(frame->hasInfo && frame->info.adcNs != 0) {
+            int64_t sent = monotonicNow();
+            adcToAnalysed.record(frame->info.analysedNs - frame->info.adcNs);
+            analysedToSent.record(sent - frame->info.analysedNs);
+            adcToSent.record(sent - frame->info.adcNs);
+        }
+        if(config.confirms) {
+            //The broker numbers publishes on a confirm channel 1, 2, 3...
+            unconfirmed[nextTag % config.confirmWindow] = true;
+            nextTag++;
+            readConfirms(false);
+        }
+    }
+
+    //CLOCK_REALTIME minus CLOCK_MONOTONIC, ns
+    static int64_t realtimeOffset() {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec - monotonicNow();
+    }
+
+    //Where the time went between capture and the broker, since the last report
+    void reportLatency() {
+        if(adcToSent.count() == 0) {
+            return;
+        }
+        printf("Latency over the last %d s:\n", PUBLISHER_REPORT_SECONDS);
+        adcToAnalysed.print("adc -> fft done");
+        analysedToSent.print("fft done -> publish returned");
+        adcToSent.print("adc -> publish returned");
+        adcToAnalysed.reset();
+        analysedToSent.reset();
+        adcToSent.reset();
+    }
+
+    //Confirm mode only. Wait until at most outstanding publishes are unacked.
+    //If the broker goes quiet the rest of the window is written off as nacked
+    //rather than stalling the queue forever.
+    void awaitConfirms(int outstanding) {
+        while(nextTag - oldestTag > (uint64_t) outstanding) {
+            if(!readConfirms(true)) {
+                while(oldestTag < nextTag) {
+                    if(unconfirmed[oldestTag % config.confirmWindow]) {
+                        unconfirmed[oldestTag % config.confirmWindow] = false;
+                        nacked.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    oldestTag++;
+                }
+            }
+        }
+    }
+
+    //Handle any acks and nacks the broker has sent. With wait, block up to
+    //PUBLISHER_CONFIRM_TIMEOUT for the first one. Returns false on timeout or error.
+    bool readConfirms(bool wait) {
+        struct timeval timeout;
+        timeout.tv_sec = wait ? PUBLISHER_CONFIRM_TIMEOUT : 0;
+        timeout.tv_usec = 0;
+        amqp_frame_t frame;
+        bool any = false;
+        while(amqp_simple_wait_frame_noblock(conn, &frame, &timeout) == AMQP_STATUS_OK) {
+            if(frame.frame_type != AMQP_FRAME_METHOD) {
+                continue;
+            }
+            if(frame.payload.method.id == AMQP_BASIC_ACK_METHOD) {
+                amqp_basic_ack_t *ack = (amqp_basic_ack_t *) frame.payload.method.decoded;
+                settle(ack->delivery_tag, ack->multiple, true);
+                any = true;
+            } else if(frame.payload.method.id == AMQP_BASIC_NACK_METHOD) {
+                amqp_basic_nack_t *nack = (amqp_basic_nack_t *) frame.payload.method.decoded;
+                settle(nack->delivery_tag, nack->multiple, false);
+                any = true;
+            }
+            //Once something has been settled, only drain what has already arrived
+            if(any) {
+                timeout.tv_sec = 0;
+            }
+        }
+        amqp_maybe_release_buffers(conn);
+        return any || !wait;
+    }
+
+    void settle(uint64_t tag, bool multiple, bool ack) {
+        uint64_t first = multiple ? oldestTag : tag;
+        for(uint64_t t = first; t <= tag && t < nextTag; t++) {
+            if(t < oldestTag || !unconfirmed[t % config.confirmWindow]) {
+                continue;
+            }
+            unconfirmed[t % config.confirmWindow] = false;
+            if(ack) {
+                confirmed.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                nacked.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        while(oldestTag < nextTag && !unconfirmed[oldestTag % config.confirmWindow]) {
+            oldestTag++;
+        }
+    }
+
+    SlotQueue<PublishFrame> queue;
+    amqp_connection_state_t conn;
+    amqp_channel_t channel;
+    PublisherConfig config;
+    bool running;
+    std::atomic<bool> stopping;
+    LatencyHistogram adcToAnalysed;           //I/O thread only
+    LatencyHistogram analysedToSent;
+    LatencyHistogram adcToSent;
+    sem_t ready;
+    std::thread worker;
+
+    //Confirm window, owned by the I/O thread. unconfirmed[tag % confirmWindow]
+    //is set from publish until ack; tags below oldestTag are all settled.
+    bool *unconfirmed;
+    uint64_t nextTag;
+    uint64_t oldestTag;
+};
+
+#endif
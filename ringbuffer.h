@@ -0,0 +1,246 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+
+#define CACHE_LINE_SIZE (64)
+
+//Wait-free single producer/single consumer ring buffer.
+//The producer (the portaudio callback) only ever stores head and the consumer
+//(the analysis loop) only ever stores tail, so neither side takes a lock or
+//waits on the other. Head and tail live on separate cache lines so the two
+//threads do not bounce the same line between cores.
+template <typename T>
+class SpscRing
+{
+public:
+    SpscRing() : head(0), tail(0), buffer(NULL), capacity(0), mask(0) {}
+    ~SpscRing() { delete[] buffer; }
+
+    //Allocate room for at least minCapacity elements, rounded up to a power
+    //of two so indices wrap with a mask. Must be called before the stream starts.
+    bool init(size_t minCapacity) {
+        size_t size = 1;
+        while(size < minCapacity) {
+            size <<= 1;
+        }
+        delete[] buffer;
+        buffer = new (std::nothrow) T[size];
+        if(buffer == NULL) {
+            return false;
+        }
+        capacity = size;
+        mask = size - 1;
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t size() const { return capacity; }
+
+    //Number of elements the consumer can read. Safe from either thread.
+    size_t readAvailable() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    //Number of elements the producer can write. Safe from either thread.
+    size_t writeAvailable() const {
+        return capacity - readAvailable();
+    }
+
+    //Producer side. Copies up to n elements taken every stride elements of
+    //src. Returns how many were written; anything beyond that did not fit.
+    size_t push(const T *src, size_t n, size_t stride = 1) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t space = capacity - (h - tail.load(std::memory_order_acquire));
+        if(n > space) {
+            n = space;
+        }
+        if(stride == 1) {
+            copyIn(h, src, n);
+        } else {
+            for(size_t i=0; i<n; i++) {
+                buffer[(h + i) & mask] = src[i * stride];
+            }
+        }
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    //Producer side. Writes n copies of value, used when the callback gets no input.
+    size_t fill(const T &value, size_t n) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t space = capacity - (h - tail.load(std::memory_order_acquire));
+        if(n > space) {
+            n = space;
+        }
+        for(size_t i=0; i<n; i++) {
+            buffer[(h + i) & mask] = value;
+        }
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    //Producer side. The contiguous free space at the write position, for
+    //filling in place without a copy; *n is how many elements fit there. Make
+    //them visible to the consumer with commitWrite.
+    T *writeRegion(size_t *n) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t space = capacity - (h - tail.load(std::memory_order_acquire));
+        size_t start = h & mask;
+        *n = capacity - start < space ? capacity - start : space;
+        return buffer + start;
+    }
+
+    //Producer side. Publish n elements written through writeRegion.
+    void commitWrite(size_t n) {
+        head.store(head.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    //Consumer side. Copies exactly n elements into dst, or nothing at all if
+    //fewer than n are available, so callers always see whole frames.
+    bool pop(T *dst, size_t n) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if(head.load(std::memory_order_acquire) - t < n) {
+            return false;
+        }
+        copyOut(t, dst, n);
+        tail.store(t + n, std::memory_order_release);
+        return true;
+    }
+
+private:
+    SpscRing(const SpscRing &);
+    SpscRing &operator=(const SpscRing &);
+
+    void copyIn(size_t pos, const T *src, size_t n) {
+        size_t start = pos & mask;
+        size_t first = capacity - start < n ? capacity - start : n;
+        memcpy(buffer + start, src, first * sizeof(T));
+        memcpy(buffer, src + first, (n - first) * sizeof(T));
+    }
+
+    void copyOut(size_t pos, T *dst, size_t n) const {
+        size_t start = pos & mask;
+        size_t first = capacity - start < n ? capacity - start : n;
+        memcpy(dst, buffer + start, first * sizeof(T));
+        memcpy(dst + first, buffer, (n - first) * sizeof(T));
+    }
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+    alignas(CACHE_LINE_SIZE) T *buffer;
+    size_t capacity;
+    size_t mask;
+};
+
+//Bounded multi producer/multi consumer queue of preallocated slots, after
+//Dmitry Vyukov's sequence-numbered ring. Each slot carries a sequence number
+//that says whether it is free for the producer at that position or filled for
+//the consumer, so callers encode into and read out of the slots in place and
+//nothing is copied or allocated. Producers may also pop, which is how the
+//publisher drops its oldest frame when full.
+template <typename T>
+class SlotQueue
+{
+public:
+    SlotQueue() : head(0), tail(0), slots(NULL), capacity(0), mask(0) {}
+    ~SlotQueue() { delete[] slots; }
+
+    bool init(size_t minCapacity) {
+        size_t size = 2;
+        while(size < minCapacity) {
+            size <<= 1;
+        }
+        delete[] slots;
+        slots = new (std::nothrow) Slot[size];
+        if(slots == NULL) {
+            return false;
+        }
+        for(size_t i=0; i<size; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        capacity = size;
+        mask = size - 1;
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t size() const { return capacity; }
+
+    //Every slot, for preallocating their contents before the queue is used
+    T &at(size_t i) { return slots[i].value; }
+
+    //Claim the next free slot to fill, or NULL if the queue is full.
+    //The slot must be handed back with commitPush(ticket).
+    T *claimPush(size_t *ticket) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while(1) {
+            Slot *slot = &slots[pos & mask];
+            size_t seq = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if(diff == 0) {
+                if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    *ticket = pos;
+                    return &slot->value;
+                }
+            } else if(diff < 0) {
+                return NULL;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void commitPush(size_t ticket) {
+        slots[ticket & mask].sequence.store(ticket + 1, std::memory_order_release);
+    }
+
+    //Claim the oldest filled slot, or NULL if the queue is empty.
+    //The slot must be released with commitPop(ticket) once it has been read.
+    T *claimPop(size_t *ticket) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while(1) {
+            Slot *slot = &slots[pos & mask];
+            size_t seq = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+            if(diff == 0) {
+                if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    *ticket = pos;
+                    return &slot->value;
+                }
+            } else if(diff < 0) {
+                return NULL;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void commitPop(size_t ticket) {
+        slots[ticket & mask].sequence.store(ticket + capacity, std::memory_order_release);
+    }
+
+private:
+    SlotQueue(const SlotQueue &);
+    SlotQueue &operator=(const SlotQueue &);
+
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+    alignas(CACHE_LINE_SIZE) Slot *slots;
+    size_t capacity;
+    size_t mask;
+};
+
+#endif
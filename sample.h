@@ -0,0 +1,416 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <new>
+
+#include "libs/portaudio.h"
+
+#include "ringbuffer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_X86 (1)
+#endif
+
+//Capture sample formats.
+//Audio stays in the format the device delivers from portaudio through the
+//ring, and is converted to float only as the analysis takes each hop, by a
+//kernel picked for the CPU. Converted samples are in 16 bit units (full
+//scale +-32768) whatever the format, so the levels published do not depend
+//on which one was captured.
+
+enum SampleFormat
+{
+    SAMPLE_AUTO = 0,       //the first format portaudio says the device supports
+    SAMPLE_INT8 = 1,
+    SAMPLE_UINT8 = 2,
+    SAMPLE_INT16 = 3,
+    SAMPLE_INT24 = 4,
+    SAMPLE_FLOAT32 = 5
+};
+
+//Packed little-endian 24 bit sample, as portaudio delivers paInt24
+typedef struct
+{
+    uint8_t bytes[3];
+}
+Int24;
+
+typedef void (*SampleKernel)(const void *src, float *dst, size_t n);
+
+template <typename T> struct SampleTraits;
+
+template <> struct SampleTraits<int8_t>
+{
+    static SampleFormat format() { return SAMPLE_INT8; }
+    static PaSampleFormat paFormat() { return paInt8; }
+    static int8_t silence() { return 0; }
+    static float toFloat(int8_t s) { return s * 256.0f; }
+    static int8_t fromUnit(float x) { return (int8_t) lrintf(x * 127); }
+};
+
+template <> struct SampleTraits<uint8_t>
+{
+    static SampleFormat format() { return SAMPLE_UINT8; }
+    static PaSampleFormat paFormat() { return paUInt8; }
+    static uint8_t silence() { return 128; }
+    static float toFloat(uint8_t s) { return (s - 128) * 256.0f; }
+    static uint8_t fromUnit(float x) { return (uint8_t) (128 + lrintf(x * 127)); }
+};
+
+template <> struct SampleTraits<int16_t>
+{
+    static SampleFormat format() { return SAMPLE_INT16; }
+    static PaSampleFormat paFormat() { return paInt16; }
+    static int16_t silence() { return 0; }
+    static float toFloat(int16_t s) { return s; }
+    static int16_t fromUnit(float x) { return (int16_t) lrintf(x * 32767); }
+};
+
+template <> struct SampleTraits<Int24>
+{
+    static SampleFormat format() { return SAMPLE_INT24; }
+    static PaSampleFormat paFormat() { return paInt24; }
+    static Int24 silence() { Int24 s = { { 0, 0, 0 } }; return s; }
+    static float toFloat(Int24 s) {
+        int32_t value = (int32_t) ((uint32_t) s.bytes[0] << 8 | (uint32_t) s.bytes[1] << 16 | (uint32_t) s.bytes[2] << 24) >> 8;
+        return value * (1.0f / 256);
+    }
+    static Int24 fromUnit(float x) {
+        uint32_t value = (uint32_t) (int32_t) lrintf(x * 8388607);
+        Int24 s = { { (uint8_t) value, (uint8_t) (value >> 8), (uint8_t) (value >> 16) } };
+        return s;
+    }
+};
+
+template <> struct SampleTraits<float>
+{
+    static SampleFormat format() { return SAMPLE_FLOAT32; }
+    static PaSampleFormat paFormat() { return paFloat32; }
+    static float silence() { return 0; }
+    static float toFloat(float s) { return s * 32768.0f; }
+    static float fromUnit(float x) { return x; }
+};
+
+inline const char *sampleFormatName(SampleFormat format) {
+    switch(format) {
+        case SAMPLE_INT8:    return "int8";
+        case SAMPLE_UINT8:   return "uint8";
+        case SAMPLE_INT16:   return "int16";
+        case SAMPLE_INT24:   return "int24";
+        case SAMPLE_FLOAT32: return "float32";
+        default:             return "auto";
+    }
+}
+
+//Store n samples in -1..1 as format, the reverse of what a device delivers.
+//Used for generated audio, so plain scalar code.
+template <typename T>
+inline void sampleFromUnitScalar(const float *src, void *dst, size_t n) {
+    T *out = (T *) dst;
+    for(size_t i=0; i<n; i++) {
+        out[i] = SampleTraits<T>::fromUnit(src[i]);
+    }
+}
+
+inline void sampleFromUnit(SampleFormat format, const float *src, void *dst, size_t n) {
+    switch(format) {
+        case SAMPLE_INT8:    sampleFromUnitScalar<int8_t>(src, dst, n); break;
+        case SAMPLE_UINT8:   sampleFromUnitScalar<uint8_t>(src, dst, n); break;
+        case SAMPLE_INT16:   sampleFromUnitScalar<int16_t>(src, dst, n); break;
+        case SAMPLE_INT24:   sampleFromUnitScalar<Int24>(src, dst, n); break;
+        case SAMPLE_FLOAT32: sampleFromUnitScalar<float>(src, dst, n); break;
+        default:             break;
+    }
+}
+
+inline size_t sampleFormatBytes(SampleFormat format) {
+    switch(format) {
+        case SAMPLE_INT8:    return sizeof(int8_t);
+        case SAMPLE_UINT8:   return sizeof(uint8_t);
+        case SAMPLE_INT16:   return sizeof(int16_t);
+        case SAMPLE_INT24:   return sizeof(Int24);
+        case SAMPLE_FLOAT32: return sizeof(float);
+        default:             return 0;
+    }
+}
+
+inline PaSampleFormat samplePaFormat(SampleFormat format) {
+    switch(format) {
+        case SAMPLE_INT8:    return paInt8;
+        case SAMPLE_UINT8:   return paUInt8;
+        case SAMPLE_INT16:   return paInt16;
+        case SAMPLE_INT24:   return paInt24;
+        case SAMPLE_FLOAT32: return paFloat32;
+        default:             return 0;
+    }
+}
+
+template <typename T>
+inline void sampleKernelScalar(const void *src, float *dst, size_t n) {
+    const T *in = (const T *) src;
+    for(size_t i=0; i<n; i++) {
+        dst[i] = SampleTraits<T>::toFloat(in[i]);
+    }
+}
+
+#ifdef SAMPLE_X86
+//Sign extend the eight int16 in x to floats, scaled
+inline void sampleStoreInt16Sse2(__m128i x, __m128 scale, float *dst) {
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_ps(dst, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+}
+
+inline void sampleKernelInt16Sse2(const void *src, float *dst, size_t n) {
+    const int16_t *in = (const int16_t *) src;
+    __m128 scale = _mm_set1_ps(1.0f);
+    size_t i = 0;
+    for(; i+8<=n; i+=8) {
+        sampleStoreInt16Sse2(_mm_loadu_si128((const __m128i *) (in + i)), scale, dst + i);
+    }
+    sampleKernelScalar<int16_t>(in + i, dst + i, n - i);
+}
+
+//uint8 is int8 with the sign bit flipped, so both share this with a bias
+inline void sampleKernel8Sse2(const uint8_t *in, float *dst, size_t n, __m128i bias) {
+    __m128 scale = _mm_set1_ps(256.0f);
+    for(size_t i=0; i+16<=n; i+=16) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (in + i)), bias);
+        sampleStoreInt16Sse2(_mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8), scale, dst + i);
+        sampleStoreInt16Sse2(_mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8), scale, dst + i + 8);
+    }
+}
+
+inline void sampleKernelInt8Sse2(const void *src, float *dst, size_t n) {
+    size_t whole = n & ~(size_t) 15;
+    sampleKernel8Sse2((const uint8_t *) src, dst, whole, _mm_setzero_si128());
+    sampleKernelScalar<int8_t>((const int8_t *) src + whole, dst + whole, n - whole);
+}
+
+inline void sampleKernelUInt8Sse2(const void *src, float *dst, size_t n) {
+    size_t whole = n & ~(size_t) 15;
+    sampleKernel8Sse2((const uint8_t *) src, dst, whole, _mm_set1_epi8((char) 0x80));
+    sampleKernelScalar<uint8_t>((const uint8_t *) src + whole, dst + whole, n - whole);
+}
+
+inline void sampleKernelFloat32Sse2(const void *src, float *dst, size_t n) {
+    const float *in = (const float *) src;
+    __m128 scale = _mm_set1_ps(32768.0f);
+    size_t i = 0;
+    for(; i+4<=n; i+=4) {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(in + i), scale));
+    }
+    sampleKernelScalar<float>(in + i, dst + i, n - i);
+}
+
+//Four packed 24 bit samples per shuffle, each moved to the top of a 32 bit
+//lane so an arithmetic shift sign extends it. Loads 16 bytes for 12, so
+//stops while a whole load still fits.
+__attribute__((target("ssse3")))
+inline void sampleKernelInt24Ssse3(const void *src, float *dst, size_t n) {
+    const uint8_t *in = (const uint8_t *) src;
+    const __m128i spread = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m128 scale = _mm_set1_ps(1.0f / 256);
+    size_t i = 0;
+    for(; (i + 4) * 3 + 4 <= n * 3; i+=4) {
+        __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + i * 3)), spread);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(x, 8)), scale));
+    }
+    sampleKernelScalar<Int24>(in + i * 3, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void sampleKernelInt16Avx2(const void *src, float *dst, size_t n) {
+    const int16_t *in = (const int16_t *) src;
+    size_t i = 0;
+    for(; i+8<=n; i+=8) {
+        __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (in + i)));
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(x));
+    }
+    sampleKernelScalar<int16_t>(in + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void sampleKernelInt8Avx2(const void *src, float *dst, size_t n) {
+    const int8_t *in = (const int8_t *) src;
+    __m256 scale = _mm256_set1_ps(256.0f);
+    size_t i = 0;
+    for(; i+8<=n; i+=8) {
+        __m256i x = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (in + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+    }
+    sampleKernelScalar<int8_t>(in + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void sampleKernelUInt8Avx2(const void *src, float *dst, size_t n) {
+    const uint8_t *in = (const uint8_t *) src;
+    __m256 scale = _mm256_set1_ps(256.0f);
+    __m256i bias = _mm256_set1_epi32(128);
+    size_t i = 0;
+    for(; i+8<=n; i+=8) {
+        __m256i x = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (in + i))), bias);
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+    }
+    sampleKernelScalar<uint8_t>(in + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void sampleKernelFloat32Avx2(const void *src, float *dst, size_t n) {
+    const float *in = (const float *) src;
+    __m256 scale = _mm256_set1_ps(32768.0f);
+    size_t i = 0;
+    for(; i+8<=n; i+=8) {
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(in + i), scale));
+    }
+    sampleKernelScalar<float>(in + i, dst + i, n - i);
+}
+#endif
+
+//The widest conversion kernel the CPU supports for T
+template <typename T>
+inline SampleKernel sampleKernel(const char **name) {
+    *name = "scalar";
+    return sampleKernelScalar<T>;
+}
+
+#ifdef SAMPLE_X86
+template <>
+inline SampleKernel sampleKernel<int8_t>(const char **name) {
+    *name = __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+    return __builtin_cpu_supports("avx2") ? sampleKernelInt8Avx2 : sampleKernelInt8Sse2;
+}
+
+template <>
+inline SampleKernel sampleKernel<uint8_t>(const char **name) {
+    *name = __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+    return __builtin_cpu_supports("avx2") ? sampleKernelUInt8Avx2 : sampleKernelUInt8Sse2;
+}
+
+template <>
+inline SampleKernel sampleKernel<int16_t>(const char **name) {
+    *name = __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+    return __builtin_cpu_supports("avx2") ? sampleKernelInt16Avx2 : sampleKernelInt16Sse2;
+}
+
+template <>
+inline SampleKernel sampleKernel<Int24>(const char **name) {
+    if(__builtin_cpu_supports("ssse3")) {
+        *name = "ssse3";
+        return sampleKernelInt24Ssse3;
+    }
+    *name = "scalar";
+    return sampleKernelScalar<Int24>;
+}
+
+template <>
+inline SampleKernel sampleKernel<float>(const char **name) {
+    *name = __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+    return __builtin_cpu_supports("avx2") ? sampleKernelFloat32Avx2 : sampleKernelFloat32Sse2;
+}
+#endif
+
+//Ring of captured samples whose type is picked at runtime. The producer
+//makes one call per portaudio block and the consumer converts a whole hop
+//per call, so going through the virtual calls costs nothing measurable.
+class SampleRing
+{
+public:
+    SampleRing() : format(SAMPLE_AUTO), paFormat(0), sampleBytes(0), kernelName("") {}
+    virtual ~SampleRing() {}
+
+    //The rings inside keep their head and tail on separate cache lines, which
+    //plain new does not align for before C++17
+    static void *operator new(size_t size, const std::nothrow_t &) throw() {
+        void *memory;
+        return posix_memalign(&memory, CACHE_LINE_SIZE, size) == 0 ? memory : NULL;
+    }
+    static void operator delete(void *memory) { free(memory); }
+
+    //Room for at least minCapacity samples; pops of up to maxPop at a time
+    virtual bool init(size_t minCapacity, size_t maxPop) = 0;
+    virtual size_t size() const = 0;
+    virtual size_t readAvailable() const = 0;
+    virtual size_t writeAvailable() const = 0;
+
+    //Producer side, counts in samples of this ring's format
+    virtual size_t push(const void *src, size_t n) = 0;
+    virtual size_t fillSilence(size_t n) = 0;
+    virtual void *writeRegion(size_t *n) = 0;
+    virtual void commitWrite(size_t n) = 0;
+
+    //Consumer side. Converts exactly n samples into dst, or takes nothing at
+    //all if fewer than n are available.
+    virtual bool popFloat(float *dst, size_t n) = 0;
+
+    SampleFormat format;
+    PaSampleFormat paFormat;
+    size_t sampleBytes;
+    const char *kernelName;
+
+private:
+    SampleRing(const SampleRing &);
+    SampleRing &operator=(const SampleRing &);
+};
+
+template <typename T>
+class TypedSampleRing : public SampleRing
+{
+public:
+    TypedSampleRing() : scratch(NULL), scratchSize(0) {
+        format = SampleTraits<T>::format();
+        paFormat = SampleTraits<T>::paFormat();
+        sampleBytes = sizeof(T);
+        kernel = sampleKernel<T>(&kernelName);
+    }
+    ~TypedSampleRing() { delete[] scratch; }
+
+    bool init(size_t minCapacity, size_t maxPop) {
+        delete[] scratch;
+        scratch = new (std::nothrow) T[maxPop];
+        scratchSize = scratch != NULL ? maxPop : 0;
+        return scratch != NULL && ring.init(minCapacity);
+    }
+
+    size_t size() const { return ring.size(); }
+    size_t readAvailable() const { return ring.readAvailable(); }
+    size_t writeAvailable() const { return ring.writeAvailable(); }
+    size_t push(const void *src, size_t n) { return ring.push((const T *) src, n); }
+    size_t fillSilence(size_t n) { return ring.fill(SampleTraits<T>::silence(), n); }
+    void *writeRegion(size_t *n) { return ring.writeRegion(n); }
+    void commitWrite(size_t n) { ring.commitWrite(n); }
+
+    bool popFloat(float *dst, size_t n) {
+        if(n > scratchSize || !ring.pop(scratch, n)) {
+            return false;
+        }
+        kernel(scratch, dst, n);
+        return true;
+    }
+
+private:
+    SpscRing<T> ring;
+    T *scratch;
+    size_t scratchSize;
+    SampleKernel kernel;
+};
+
+inline SampleRing *sampleRingCreate(SampleFormat format) {
+    switch(format) {
+        case SAMPLE_INT8:    return new (std::nothrow) TypedSampleRing<int8_t>();
+        case SAMPLE_UINT8:   return new (std::nothrow) TypedSampleRing<uint8_t>();
+        case SAMPLE_INT16:   return new (std::nothrow) TypedSampleRing<int16_t>();
+        case SAMPLE_INT24:   return new (std::nothrow) TypedSampleRing<Int24>();
+        case SAMPLE_FLOAT32: return new (std::nothrow) TypedSampleRing<float>();
+        default:             return NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <atomic>
+
+//Seconds between reports of the achieved publish rate
+#define SCHEDULER_REPORT_SECONDS (10)
+
+inline int64_t monotonicNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+//Sleep until deadline, in monotonicNow() ns, however often a signal interrupts
+inline void sleepUntil(int64_t deadline) {
+    struct timespec until;
+    until.tv_sec = deadline / 1000000000LL;
+    until.tv_nsec = deadline % 1000000000LL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+    }
+}
+
+//Wakes the analysis loop from the audio callback once a hop of samples is
+//ready, instead of the loop sleeping and guessing how much audio arrived.
+//Backed by an eventfd so the callback only does one non-blocking write.
+class FrameSignal
+{
+public:
+    FrameSignal() : fd(-1) {}
+    ~FrameSignal() {
+        if(fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool init() {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return fd >= 0;
+    }
+
+    //Callback side. Safe to call any number of times before the loop wakes.
+    void notify() {
+        uint64_t one = 1;
+        ssize_t written = write(fd, &one, sizeof(one));
+        (void) written;
+    }
+
+    //Consume pending notifications. Returns true if there were any.
+    bool clear() {
+        uint64_t count;
+        return read(fd, &count, sizeof(count)) == sizeof(count);
+    }
+
+    int descriptor() const { return fd; }
+
+private:
+    int fd;
+};
+
+//Sleep until one of count signals is notified or the monotonic deadline (ns)
+//passes, INT64_MAX to wait for a signal only. ready[i] says whether signal i
+//was notified; its notifications are consumed.
+inline void waitAny(FrameSignal *const *signals, struct pollfd *fds, bool *ready, int count, int64_t deadline) {
+    int64_t remaining = deadline - monotonicNow();
+    if(remaining < 0) {
+        remaining = 0;
+    }
+    struct timespec timeout;
+    timeout.tv_sec = remaining / 1000000000LL;
+    timeout.tv_nsec = remaining % 1000000000LL;
+    for(int i=0; i<count; i++) {
+        fds[i].fd = signals[i]->descriptor();
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    int woken = ppoll(fds, count, deadline == INT64_MAX ? NULL : &timeout, NULL);
+    for(int i=0; i<count; i++) {
+        ready[i] = woken > 0 && (fds[i].revents & POLLIN) && signals[i]->clear();
+    }
+}
+
+//Fixed rate publish schedule on the monotonic clock.
+//Deadlines are start + n*period rather than "last publish + period", so
+//wake-up jitter and processing time never accumulate into drift. Ticks that
+//are missed entirely are skipped and counted instead of published in a burst.
+//due() and report() belong to whichever thread publishes; deadline() may be
+//read from any thread.
+class PublishClock
+{
+public:
+    PublishClock() : period(0), next(0), ticks(0), missed(0), worstLateness(0),
+        windowStart(0), windowTicks(0) {}
+
+    void start(double rate) {
+        period = (int64_t) (1000000000.0 / rate);
+        next.store(monotonicNow() + period);
+        windowStart = monotonicNow();
+        windowTicks = 0;
+    }
+
+    int64_t deadline() const { return next.load(std::memory_order_relaxed); }
+
+    //True if a publish is due at now. Advances the schedule when it is.
+    bool due(int64_t now) {
+        int64_t deadline = next.load(std::memory_order_relaxed);
+        if(now < deadline) {
+            return false;
+        }
+        int64_t lateness = now - deadline;
+        if(lateness > worstLateness) {
+            worstLateness = lateness;
+        }
+        deadline += period;
+        while(deadline <= now) {
+            deadline += period;
+            missed++;
+        }
+        next.store(deadline, std::memory_order_relaxed);
+        ticks++;
+        windowTicks++;
+        return true;
+    }
+
+    //Print the rate achieved since the last report, every SCHEDULER_REPORT_SECONDS
+    void report(int64_t now, const char *name) {
+        int64_t elapsed = now - windowStart;
+        if(elapsed < SCHEDULER_REPORT_SECONDS * 1000000000LL) {
+            return;
+        }
+        printf("%s: publishing at %.2f Hz (target %.2f Hz), %lu missed ticks, worst lateness %.2f ms\n",
+            name, windowTicks * 1e9 / elapsed, 1e9 / period, missed, worstLateness / 1e6);
+        windowStart = now;
+        windowTicks = 0;
+        worstLateness = 0;
+    }
+
+    int64_t period;              //ns between publishes
+    std::atomic<int64_t> next;   //monotonic ns of the next publish
+    unsigned long ticks;
+    unsigned long missed;
+    int64_t worstLateness;       //ns, since the last report
+
+private:
+    int64_t windowStart;
+    unsigned long windowTicks;
+};
+
+#endif
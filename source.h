@@ -0,0 +1,827 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <thread>
+
+#include "libs/portaudio.h"
+
+#include "sample.h"
+#include "alsa.h"
+#include "audiofile.h"
+#include "synth.h"
+#include "ringbuffer.h"
+#include "scheduler.h"
+#include "analysis.h"
+#include "publisher.h"
+#include "config.h"
+#include "pool.h"
+
+//Print every device portaudio can capture from, for picking --device
+inline void listInputDevices() {
+    for(int i=0; i<Pa_GetDeviceCount(); i++) {
+        const PaDeviceInfo *info = Pa_GetDeviceInfo(i);
+        if(info->maxInputChannels > 0) {
+            printf("%3d  %s (%d channels, %.0f Hz)\n", i, info->name, info->maxInputChannels, info->defaultSampleRate);
+        }
+    }
+}
+
+//Resolve --device, an index or part of a device name, to a device index
+inline PaDeviceIndex findInputDevice(const char *device) {
+    if(device[0] == '\0') {
+        return Pa_GetDefaultInputDevice();
+    }
+    char *end;
+    long index = strtol(device, &end, 10);
+    if(*end == '\0') {
+        return index >= 0 && index < Pa_GetDeviceCount() ? (PaDeviceIndex) index : paNoDevice;
+    }
+    for(int i=0; i<Pa_GetDeviceCount(); i++) {
+        const PaDeviceInfo *info = Pa_GetDeviceInfo(i);
+        if(info->maxInputChannels > 0 && strstr(info->name, device) != NULL) {
+            return i;
+        }
+    }
+    return paNoDevice;
+}
+
+inline int64_t threadCpuNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+//When the first frame of a block was captured. Frames count from when the
+//stream opened, so the analysis can time any frame it takes from the ring.
+typedef struct
+{
+    uint64_t frame;
+    int64_t adcNs;             //CLOCK_MONOTONIC
+    double adcTime;            //portaudio stream time
+}
+BlockTime;
+
+//Plain copy of a source's capture counters, totals since it was opened
+typedef struct
+{
+    unsigned long blocks;
+    unsigned long overflows;   //blocks portaudio flagged paInputOverflow, or overflowed blocking reads
+    unsigned long underflows;  //blocks flagged paInputUnderflow
+    unsigned long truncated;   //blocks cut short because the ring was full
+    unsigned long partial;     //callbacks with fewer frames than frames-per-buffer
+    unsigned long silent;      //callbacks without an input buffer, queued as silence
+    unsigned long dropped;     //samples lost to truncation
+    unsigned long restarts;    //times the watchdog found the stream stalled
+    int64_t busyNs;            //handling blocks, callback wall time or capture thread cpu time
+}
+CaptureTotals;
+
+//Producer side counters, written only by the callback or the capture thread
+//and read from any thread. All plain relaxed atomics, so the callback never
+//waits on a reader.
+struct CaptureStats
+{
+    CaptureStats() : blocks(0), overflows(0), underflows(0), truncated(0), partial(0), silent(0), dropped(0),
+        restarts(0), busyNs(0), worstNs(0), worstDepth(0), lastNotify(0), lastBlock(0) {}
+
+    void load(CaptureTotals *totals) const {
+        totals->blocks = blocks.load(std::memory_order_relaxed);
+        totals->overflows = overflows.load(std::memory_order_relaxed);
+        totals->underflows = underflows.load(std::memory_order_relaxed);
+        totals->truncated = truncated.load(std::memory_order_relaxed);
+        totals->partial = partial.load(std::memory_order_relaxed);
+        totals->silent = silent.load(std::memory_order_relaxed);
+        totals->dropped = dropped.load(std::memory_order_relaxed);
+        totals->restarts = restarts.load(std::memory_order_relaxed);
+        totals->busyNs = busyNs.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<unsigned long> blocks;
+    std::atomic<unsigned long> overflows;
+    std::atomic<unsigned long> underflows;
+    std::atomic<unsigned long> truncated;
+    std::atomic<unsigned long> partial;
+    std::atomic<unsigned long> silent;
+    std::atomic<unsigned long> dropped;
+    std::atomic<unsigned long> restarts;
+    std::atomic<int64_t> busyNs;
+    std::atomic<int64_t> worstNs;              //since the last report
+    std::atomic<long> worstDepth;              //frames waiting in the stream before a blocking read, since the last report
+    std::atomic<int64_t> lastNotify;           //monotonic ns the frame signal was last raised
+    std::atomic<int64_t> lastBlock;            //monotonic ns a block last arrived, for the watchdog
+};
+
+//How long fast replay waits for the analysis to make room in the ring
+#define FILE_REPLAY_BACKOFF_NS (200000)
+
+//Pick the first format portaudio says the device can capture in, with the
+//usual native hardware formats first. Some host APIs report formats they
+//would convert to as supported too, so --sample-format can force one.
+inline SampleFormat sampleFormatProbe(PaStreamParameters *parameters, double sampleRate) {
+    static const SampleFormat preference[] = { SAMPLE_INT16, SAMPLE_INT24, SAMPLE_FLOAT32, SAMPLE_INT8, SAMPLE_UINT8 };
+    for(size_t i=0; i<sizeof(preference) / sizeof(preference[0]); i++) {
+        parameters->sampleFormat = samplePaFormat(preference[i]);
+        if(Pa_IsFormatSupported(parameters, NULL, sampleRate) == paFormatIsSupported) {
+            return preference[i];
+        }
+    }
+    return SAMPLE_AUTO;
+}
+
+//One capture device and everything downstream of it up to the publisher.
+//Audio reaches samples, kept in the format the device captures in, either
+//from the portaudio callback or, with --capture blocking, from a capture
+//thread that reads fixed blocks with Pa_ReadStream straight into the ring so
+//nothing at all runs in the realtime callback. Either way the producer
+//signals once a hop is waiting; the dispatcher then schedules the source on
+//the shared worker pool, at most one task per source at a time so its frames
+//are analysed and published in order.
+//
+//A "file:" device replays a recording instead, from a thread that copies
+//blocks out of the mapped file into the ring. Paced at the sample rate it
+//stands in for a live device; run as fast as possible it publishes by sample
+//time rather than wall time, one spectrum per publish interval of audio, and
+//the source finishes once the file has been analysed. A "synth:" device is
+//replayed the same way from a signal generator, and never finishes.
+class Source
+{
+public:
+    Source() : index(0), samples(NULL), wakeSamples(0), publisher(NULL), format(WIRE_FLOAT32), scheduled(false),
+        sampleRate(0), sequence(0), havePending(false), publishedDark(false), lastPublishNs(0), keepaliveNs(0), stream(NULL), producedFrames(0),
+        block(NULL), blockFrames(0), callbackPriority(0), priorityPending(false), priorityError(0), capturing(false), reportStart(0), fromFile(false), fromSynth(false), filePaced(false), fileLoop(false), finished(false),
+        sampleClocked(false), publishFrames(0), nextPublish(0) {
+        name[0] = '\0';
+        memset(&lastTime, 0, sizeof(lastTime));
+        memset(&config, 0, sizeof(config));
+        memset(&reported, 0, sizeof(reported));
+    }
+    ~Source() {
+        close();
+        delete samples;
+    }
+
+    bool init(int sourceIndex, const SourceConfig &sourceConfig, const Config &settings, FftPlanCache *plans, Publisher *pub) {
+        index = sourceIndex;
+        config = sourceConfig;
+        publisher = pub;
+        format = settings.format;
+        snprintf(name, sizeof(name), "source %d", sourceIndex);
+        FftPlan *plan = plans->get(settings.frameSize, config.channels, FFTW_MEASURE,
+            settings.wisdomDir[0] ? settings.wisdomDir : NULL, settings.fftFastStart);
+        wakeSamples = settings.hop * config.channels;
+        clock.start(settings.publishRate > 0 ? settings.publishRate : (double) settings.sampleRate / settings.hop);
+        fromFile = audioFileIsDevice(config.device);
+        fromSynth = synthIsDevice(config.device);
+        filePaced = settings.filePacing == FILE_REALTIME;
+        fileLoop = settings.fileLoop;
+        sampleClocked = (fromFile || fromSynth) && !filePaced;
+        publishFrames = settings.publishRate > 0 ? (uint64_t) (settings.sampleRate / settings.publishRate + 0.5) : settings.hop;
+        if(publishFrames == 0) {
+            publishFrames = 1;
+        }
+        nextPublish = publishFrames;
+        keepaliveNs = (int64_t) (settings.idle.keepaliveSeconds * 1e9);
+        return plan != NULL
+            && signal.init()
+            && analyser.init(plan, settings.hop, settings.window, settings.bins, settings.binLayout, settings.smoothFactor,
+                settings.noiseGate, settings.normaliser, settings.envelope, settings.idle,
+                settings.sampleRate);
+    }
+
+    //Pick the sample format, then open and start the input stream, tuned
+    //for ALSA if that is what it runs on. Prints what went wrong on failure.
+    PaError open(const Config &settings) {
+        if(fromFile) {
+            return openFile(settings);
+        }
+        if(fromSynth) {
+            return openSynth(settings);
+        }
+        PaStreamParameters inputParameters;
+        AlsaStreamInfo alsaInfo;
+        memset(&inputParameters, 0, sizeof(inputParameters));
+        if(alsaDeviceString(config.device, &inputParameters, &alsaInfo)) {
+            inputParameters.suggestedLatency = alsaDefaultInputLatency();
+            snprintf(name, sizeof(name), "%s", config.device);
+        } else {
+            inputParameters.device = findInputDevice(config.device);
+            if( inputParameters.device == paNoDevice )
+            {
+                printf("No input device matches '%s', see --list-devices.\n", config.device);
+                return paInvalidDevice;
+            }
+            inputParameters.suggestedLatency = Pa_GetDeviceInfo( inputParameters.device )->defaultLowInputLatency;
+            snprintf(name, sizeof(name), "%s", Pa_GetDeviceInfo( inputParameters.device )->name);
+        }
+        bool blocking = settings.capture == CAPTURE_BLOCKING;
+        bool alsa = alsaIsDevice(inputParameters.device);
+        inputParameters.channelCount = config.channels;
+
+        SampleFormat sampleFormat = settings.sampleFormat;
+        if(sampleFormat == SAMPLE_AUTO) {
+            sampleFormat = sampleFormatProbe(&inputParameters, settings.sampleRate);
+        }
+        delete samples;
+        samples = sampleRingCreate(sampleFormat);
+        if(samples == NULL) {
+            printf("%s supports none of the sample formats.\n", name);
+            return paSampleFormatNotSupported;
+        }
+        if(!samples->init(settings.ringSeconds * settings.sampleRate * config.channels, wakeSamples)) {
+            printf("%s: could not allocate a %.1f s sample ring.\n", name, settings.ringSeconds);
+            return paInsufficientMemory;
+        }
+        inputParameters.sampleFormat = samples->paFormat;
+
+        //The period count is global in portaudio, so set it for each stream just before it opens
+        PaError err = alsa ? alsaSetPeriods(settings.alsaPeriods) : paNoError;
+        if( err != paNoError ) {
+            return err;
+        }
+        err = Pa_OpenStream( &stream,
+                            &inputParameters,
+                            NULL,
+                            settings.sampleRate,
+                            settings.framesPerBuffer,
+                            paClipOff,
+                            blocking ? NULL : patestCallback,
+                            blocking ? NULL : this );
+        if( err != paNoError ) {
+            stream = NULL;
+            return err;
+        }
+        if(alsa && !blocking) {
+            alsaEnableRealtime(stream, settings.realtimePriority > 0);
+        }
+        //portaudio picks its own priority, so the first callback sets the configured one
+        callbackPriority = alsa && !blocking ? settings.realtimePriority : 0;
+        priorityPending = callbackPriority > 0;
+        const PaStreamInfo *info = Pa_GetStreamInfo( stream );
+        printf("Capturing %d channels of %s from %s as %s, %s, converted with the %s kernel.\n", config.channels,
+            sampleFormatName(samples->format), name, config.routingKey, blocking ? "blocking reads" : "callback",
+            samples->kernelName);
+        printf("%s: input latency %.1f ms at %.0f Hz", name, info->inputLatency * 1000, info->sampleRate);
+        if(alsa && settings.alsaPeriods > 0) {
+            printf(", %d periods", settings.alsaPeriods);
+        } else if(alsa) {
+            printf(", default periods");
+        }
+        printf(", %s scheduling\n", settings.realtimePriority > 0 && (alsa || blocking) ? "realtime" : "normal");
+
+        //Blocking reads near the ring's wrap are split, so allow for twice as many blocks
+        sampleRate = info->sampleRate > 0 ? info->sampleRate : settings.sampleRate;
+        if(!blockTimes.init(2 * samples->size() / config.channels / settings.framesPerBuffer + 16)) {
+            return paInsufficientMemory;
+        }
+
+        //Blocking reads go straight into the ring, cut short to the whole frames
+        //that fit before it wraps. Only when not one whole frame fits does a
+        //read go through block, to be copied in.
+        blockFrames = settings.framesPerBuffer;
+        if(blocking) {
+            block = malloc(blockFrames * config.channels * samples->sampleBytes);
+            if(block == NULL) {
+                return paInsufficientMemory;
+            }
+        }
+        reportStart = monotonicNow();
+        stats.lastBlock.store(reportStart, std::memory_order_relaxed);
+        err = Pa_StartStream( stream );
+        if( err != paNoError || !blocking ) {
+            return err;
+        }
+        capturing.store(true);
+        captureThread = std::thread(&Source::capture, this);
+        if(settings.realtimePriority > 0) {
+            struct sched_param param;
+            param.sched_priority = settings.realtimePriority;
+            int failed = pthread_setschedparam(captureThread.native_handle(), SCHED_FIFO, &param);
+            if(failed) {
+                printf("%s: could not make the capture thread realtime, %s\n", name, strerror(failed));
+            }
+        }
+        return paNoError;
+    }
+
+    //Restart a callback stream that has delivered nothing for seconds. A
+    //blocking read that never returns cannot be interrupted safely, so for
+    //those the stall is only reported. Call from one thread only.
+    void checkWatchdog(int64_t now, double seconds) {
+        int failed = priorityError.exchange(0, std::memory_order_relaxed);
+        if(failed) {
+            printf("%s: could not set the callback thread's realtime priority, %s\n", name, strerror(failed));
+        }
+        if(stream == NULL || seconds <= 0) {
+            return;
+        }
+        int64_t stalled = now - stats.lastBlock.load(std::memory_order_relaxed);
+        if(stalled < (int64_t) (seconds * 1e9)) {
+            return;
+        }
+        stats.restarts.fetch_add(1, std::memory_order_relaxed);
+        stats.lastBlock.store(now, std::memory_order_relaxed);
+        if(capturing.load(std::memory_order_relaxed)) {
+            printf("%s: no audio for %.1f s, the capture thread is stuck in a read\n", name, stalled / 1e9);
+            return;
+        }
+        printf("%s: no audio for %.1f s, restarting the stream\n", name, stalled / 1e9);
+        Pa_AbortStream( stream );
+        priorityPending = callbackPriority > 0;
+        PaError err = Pa_StartStream( stream );
+        if( err != paNoError ) {
+            printf("%s: restart failed, %s\n", name, Pa_GetErrorText(err));
+        }
+    }
+
+    void close() {
+        if(capturing.exchange(false)) {
+            captureThread.join();
+        }
+        file.close();
+        free(block);
+        block = NULL;
+        if(stream != NULL) {
+            Pa_StopStream( stream );
+            Pa_CloseStream( stream );
+            stream = NULL;
+        }
+    }
+
+    //Queue a task on pool unless one is already queued or running. The task
+    //goes to this source's home worker and only moves core if it is stolen.
+    void schedule(WorkerPool *pool) {
+        if(scheduled.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+        Task task;
+        task.run = runTask;
+        task.arg = this;
+        pool->submit(task, index);
+    }
+
+    //Print what the producer has done since the last report, every
+    //SCHEDULER_REPORT_SECONDS. Call from one thread only.
+    void reportCapture(int64_t now) {
+        int64_t elapsed = now - reportStart;
+        if((stream == NULL && !fromFile && !fromSynth) || elapsed < SCHEDULER_REPORT_SECONDS * 1000000000LL) {
+            return;
+        }
+        CaptureTotals totals;
+        stats.load(&totals);
+        unsigned long blocks = totals.blocks - reported.blocks;
+        printf("%s: %lu blocks, %.1f us mean, %.1f us worst, %lu overflows, %lu underflows, %lu truncated, "
+            "%lu partial, %lu silent, %lu samples dropped, %lu restarts",
+            name, blocks, blocks ? (totals.busyNs - reported.busyNs) / 1e3 / blocks : 0.0,
+            stats.worstNs.exchange(0, std::memory_order_relaxed) / 1e3,
+            totals.overflows - reported.overflows, totals.underflows - reported.underflows,
+            totals.truncated - reported.truncated, totals.partial - reported.partial,
+            totals.silent - reported.silent, totals.dropped - reported.dropped,
+            totals.restarts - reported.restarts);
+        if(stream != NULL && capturing.load(std::memory_order_relaxed)) {
+            printf(", read-available depth up to %ld frames", stats.worstDepth.exchange(0, std::memory_order_relaxed));
+        }
+        printf("\n");
+        reported = totals;
+        reportStart = now;
+    }
+
+    //When the dispatcher must next look at this source for its publish clock.
+    //Sources publishing by sample time only run when audio arrives, and a
+    //finished replay is looked at every millisecond until it is done.
+    int64_t deadline() const {
+        if(finished.load(std::memory_order_acquire)) {
+            return monotonicNow() + 1000000;
+        }
+        return sampleClocked ? INT64_MAX : clock.deadline();
+    }
+
+    //True once a file source has replayed to the end and everything it
+    //delivered has been analysed and handed to the publisher
+    bool done() const {
+        return finished.load(std::memory_order_acquire) && samples->readAvailable() < wakeSamples
+            && !scheduled.load(std::memory_order_acquire);
+    }
+
+    int index;
+    char name[256];
+    SourceConfig config;
+    SampleRing *samples;       //interleaved frames, config.channels samples each, once open
+    size_t wakeSamples;        //samples in one hop, when the callback signals
+    FrameSignal signal;
+    PublishClock clock;
+    Analyser analyser;
+    Publisher *publisher;
+    WireFormat format;
+    std::atomic<bool> scheduled;
+    CaptureStats stats;
+    double sampleRate;         //the rate the stream actually runs at
+
+private:
+    Source(const Source &);
+    Source &operator=(const Source &);
+
+    static void runTask(void *arg) {
+        ((Source *) arg)->run();
+    }
+
+    //Analyse whatever has arrived and publish if the clock says so. Having
+    //cleared scheduled, look again in case the callback signalled meanwhile.
+    //Publishing by sample time goes a hop at a time so that every interval
+    //gets its spectrum however much audio is waiting.
+    void run() {
+        do {
+            if(sampleClocked) {
+                while(analyser.consume(samples, 1)) {
+                    if(analyser.frames >= nextPublish) {
+                        publishLatest(monotonicNow());
+                        while(nextPublish <= analyser.frames) {
+                            nextPublish += publishFrames;
+                        }
+                    }
+                }
+            } else {
+                analyser.consume(samples);
+                int64_t now = monotonicNow();
+                if(clock.due(now) && analyser.analysed) {
+                    publishLatest(now);
+                }
+                clock.report(now, name);
+            }
+            scheduled.store(false, std::memory_order_release);
+        } while(samples->readAvailable() >= wakeSamples && !scheduled.exchange(true, std::memory_order_acq_rel));
+    }
+
+    //Once the spectrum goes dark, from the noise gate or because the source
+    //is idle, one all-zero frame is published so consumers go dark too. After
+    //that only a keep-alive goes out every keepaliveNs until it lights up again.
+    void publishLatest(int64_t now) {
+        if(analyser.dark && publishedDark && (keepaliveNs == 0 || now - lastPublishNs < keepaliveNs)) {
+            return;
+        }
+        publishedDark = analyser.dark;
+        lastPublishNs = now;
+        CaptureTotals totals;
+        FrameInfo info;
+        info.sequence = sequence++;
+        info.analysedNs = now;
+        timeOf(analyser.frames - 1, &info.adcTime, &info.adcNs);
+        stats.load(&totals);
+        info.overflows = totals.overflows;
+        info.underflows = totals.underflows;
+        info.truncated = totals.truncated;
+        info.partial = totals.partial;
+        info.silent = totals.silent;
+        info.dropped = totals.dropped;
+        info.idle = analyser.idle.idling();
+        publisher->publish(analyser.spectrum, analyser.bins, analyser.channels, format, config.routingKey, &info);
+    }
+
+    //Consumer side. When frame was captured, from the block it arrived in, or
+    //zero if no block has been timed yet.
+    void timeOf(uint64_t frame, double *adcTime, int64_t *adcNs) {
+        while(1) {
+            if(!havePending && !blockTimes.pop(&pendingTime, 1)) {
+                break;
+            }
+            havePending = true;
+            if(pendingTime.frame > frame) {
+                break;
+            }
+            lastTime = pendingTime;
+            havePending = false;
+        }
+        if(lastTime.adcNs == 0) {
+            *adcTime = 0;
+            *adcNs = 0;
+            return;
+        }
+        double offset = (double) (int64_t) (frame - lastTime.frame) / sampleRate;
+        *adcTime = lastTime.adcTime + offset;
+        *adcNs = lastTime.adcNs + (int64_t) (offset * 1e9);
+    }
+
+    //Producer side, as a block of frames goes into the ring. If the analysis
+    //is so far behind that the timestamps are full, the block is left untimed.
+    void stamp(double adcTime, int64_t adcNs, size_t frames) {
+        BlockTime time;
+        time.frame = producedFrames;
+        time.adcNs = adcNs;
+        time.adcTime = adcTime;
+        blockTimes.push(&time, 1);
+        producedFrames += frames;
+    }
+
+    //Producer side, after a block has gone into the ring
+    void delivered(int64_t busy, int64_t now) {
+        stats.blocks.fetch_add(1, std::memory_order_relaxed);
+        stats.busyNs.fetch_add(busy, std::memory_order_relaxed);
+        stats.lastBlock.store(now, std::memory_order_relaxed);
+        if(busy > stats.worstNs.load(std::memory_order_relaxed)) {
+            stats.worstNs.store(busy, std::memory_order_relaxed);
+        }
+        if(samples->readAvailable() >= wakeSamples) {
+            stats.lastNotify.store(now, std::memory_order_relaxed);
+            signal.notify();
+        }
+    }
+
+    //Blocking capture thread. Each read goes straight into the ring's free
+    //space when a whole frame fits before it wraps, and through block otherwise.
+    void capture() {
+        size_t channels = config.channels;
+        while(capturing.load(std::memory_order_relaxed)) {
+            signed long depth = Pa_GetStreamReadAvailable(stream);
+            if(depth > stats.worstDepth.load(std::memory_order_relaxed)) {
+                stats.worstDepth.store(depth, std::memory_order_relaxed);
+            }
+
+            size_t space;
+            void *region = samples->writeRegion(&space);
+            unsigned long frames = space / channels;
+            bool direct = frames > 0;
+            if(!direct) {
+                region = block;
+                frames = blockFrames;
+            } else if(frames > blockFrames) {
+                frames = blockFrames;
+            }
+
+            int64_t started = threadCpuNow();
+            PaError err = Pa_ReadStream(stream, region, frames);
+            if(err == paInputOverflowed) {
+                stats.overflows.fetch_add(1, std::memory_order_relaxed);
+            } else if(err != paNoError) {
+                fprintf(stderr, "%s: read failed, %s\n", name, Pa_GetErrorText(err));
+                break;
+            }
+            //The block's first frame was captured frames plus whatever is
+            //still waiting in the stream ago
+            double streamTime = Pa_GetStreamTime(stream);
+            int64_t now = monotonicNow();
+            signed long waiting = Pa_GetStreamReadAvailable(stream);
+            double adcTime = streamTime - (frames + (waiting > 0 ? waiting : 0)) / sampleRate;
+            int64_t adcNs = now + (int64_t) ((adcTime - streamTime) * 1e9);
+
+            size_t count = frames * channels;
+            size_t written = count;
+            if(direct) {
+                samples->commitWrite(count);
+            } else {
+                size_t room = samples->writeAvailable() / channels * channels;
+                written = samples->push(block, count < room ? count : room);
+                if(written < count) {
+                    stats.truncated.fetch_add(1, std::memory_order_relaxed);
+                    stats.dropped.fetch_add(count - written, std::memory_order_relaxed);
+                }
+            }
+            stamp(adcTime, adcNs, written / channels);
+            delivered(threadCpuNow() - started, monotonicNow());
+        }
+    }
+
+    //Map the file named by the device and start replaying it. A WAV file
+    //must match the channels and rate the pipeline was set up for.
+    PaError openFile(const Config &settings) {
+        const char *path = config.device + strlen(AUDIO_FILE_PREFIX);
+        snprintf(name, sizeof(name), "%s", path);
+        if(!file.open(path, settings.sampleFormat, config.channels, settings.sampleRate)) {
+            return paInvalidDevice;
+        }
+        if(file.channels != config.channels || file.sampleRate != settings.sampleRate) {
+            printf("%s holds %d channels at %d Hz, replay it with --channels %d --sample-rate %d.\n",
+                name, file.channels, file.sampleRate, file.channels, file.sampleRate);
+            return file.channels != config.channels ? paInvalidChannelCount : paInvalidSampleRate;
+        }
+        PaError err = prepareReplay(settings, file.format);
+        if( err != paNoError ) {
+            return err;
+        }
+        printf("Replaying %d channels of %s from %s as %s, %.1f s %s%s, converted with the %s kernel.\n",
+            config.channels, sampleFormatName(samples->format), name, config.routingKey, file.frames / sampleRate,
+            filePaced ? "in real time" : "as fast as possible", fileLoop ? " on a loop" : "", samples->kernelName);
+        startReplay();
+        return paNoError;
+    }
+
+    //Set up the generator the device names, producing --sample-format
+    //(float32 for auto) so each format's conversion kernel can be exercised
+    PaError openSynth(const Config &settings) {
+        snprintf(name, sizeof(name), "%s", config.device);
+        SampleFormat sampleFormat = settings.sampleFormat == SAMPLE_AUTO ? SAMPLE_FLOAT32 : settings.sampleFormat;
+        if(!generator.init(config.device + strlen(SYNTH_DEVICE_PREFIX), settings.sampleRate, config.channels,
+            settings.synthLevel, settings.framesPerBuffer)) {
+            return paInvalidDevice;
+        }
+        PaError err = prepareReplay(settings, sampleFormat);
+        if( err != paNoError ) {
+            return err;
+        }
+        block = malloc(blockFrames * config.channels * samples->sampleBytes);
+        if(block == NULL) {
+            return paInsufficientMemory;
+        }
+        printf("Generating %d channels of %s, %s at %.1f dBFS, as %s %s, converted with the %s kernel.\n",
+            config.channels, generator.description, sampleFormatName(samples->format), settings.synthLevel,
+            config.routingKey, filePaced ? "in real time" : "as fast as possible", samples->kernelName);
+        startReplay();
+        return paNoError;
+    }
+
+    //The ring and timestamps for a replayed source, which runs at exactly the
+    //configured rate
+    PaError prepareReplay(const Config &settings, SampleFormat sampleFormat) {
+        delete samples;
+        samples = sampleRingCreate(sampleFormat);
+        if(samples == NULL || !samples->init(settings.ringSeconds * settings.sampleRate * config.channels, wakeSamples)) {
+            return paInsufficientMemory;
+        }
+        sampleRate = settings.sampleRate;
+        blockFrames = settings.framesPerBuffer;
+        if(!blockTimes.init(samples->size() / config.channels / blockFrames + 16)) {
+            return paInsufficientMemory;
+        }
+        return paNoError;
+    }
+
+    void startReplay() {
+        reportStart = monotonicNow();
+        stats.lastBlock.store(reportStart, std::memory_order_relaxed);
+        capturing.store(true);
+        captureThread = std::thread(&Source::replay, this);
+    }
+
+    //Replay thread, a block at a time straight from the file mapping, or
+    //from the generator through block, into the ring. Paced replay sleeps
+    //until each block has been "captured" and, like a live device, drops what
+    //does not fit. Fast replay waits for room instead, so nothing is lost
+    //however far ahead of the analysis it gets. The stream time of a block is
+    //its offset into the file, or how much has been generated.
+    void replay() {
+        size_t channels = config.channels;
+        uint64_t position = 0;
+        uint64_t sent = 0;
+        int64_t start = monotonicNow();
+        while(capturing.load(std::memory_order_relaxed)) {
+            size_t frames = blockFrames;
+            if(fromFile) {
+                if(position == file.frames) {
+                    if(!fileLoop) {
+                        break;
+                    }
+                    position = 0;
+                }
+                uint64_t left = file.frames - position;
+                frames = left < blockFrames ? left : blockFrames;
+            }
+            if(frames * channels > samples->size()) {
+                frames = samples->size() / channels;
+            }
+            size_t count = frames * channels;
+            if(filePaced) {
+                sleepUntil(start + (int64_t) ((sent + frames) * 1e9 / sampleRate));
+            } else if(samples->writeAvailable() < count) {
+                sleepUntil(monotonicNow() + FILE_REPLAY_BACKOFF_NS);
+                continue;
+            }
+
+            int64_t started = monotonicNow();
+            const void *data = block;
+            if(fromFile) {
+                data = file.data + position * file.frameBytes;
+            } else {
+                generator.render(samples->format, block, frames);
+            }
+            size_t room = samples->writeAvailable() / channels * channels;
+            size_t written = samples->push(data, count < room ? count : room);
+            if(written < count) {
+                stats.truncated.fetch_add(1, std::memory_order_relaxed);
+                stats.dropped.fetch_add(count - written, std::memory_order_relaxed);
+            }
+            int64_t adcNs = filePaced ? start + (int64_t) (sent * 1e9 / sampleRate) : started;
+            stamp((fromFile ? position : sent) / sampleRate, adcNs, written / channels);
+            position += frames;
+            sent += frames;
+            int64_t now = monotonicNow();
+            delivered(now - started, now);
+        }
+        finished.store(true, std::memory_order_release);
+        signal.notify();
+    }
+
+    static int patestCallback( const void *inputBuffer, void *outputBuffer,
+                               unsigned long framesPerBuffer,
+                               const PaStreamCallbackTimeInfo* timeInfo,
+                               PaStreamCallbackFlags statusFlags,
+                               void *userData )
+    {
+        Source *source = (Source*)userData;
+        CaptureStats *stats = &source->stats;
+        size_t channels = source->config.channels;
+        size_t count = framesPerBuffer * channels;
+        size_t written;
+        int64_t started = monotonicNow();
+
+        (void) outputBuffer; /* Prevent unused variable warnings. */
+
+        //Some host APIs leave the ADC time zero, so fall back to a buffer
+        //before the callback's own time
+        double adcTime = timeInfo->inputBufferAdcTime;
+        if( adcTime == 0 )
+        {
+            adcTime = timeInfo->currentTime - framesPerBuffer / source->sampleRate;
+        }
+        int64_t adcNs = started + (int64_t) ((adcTime - timeInfo->currentTime) * 1e9);
+
+        if( source->priorityPending )
+        {
+            struct sched_param param;
+            param.sched_priority = source->callbackPriority;
+            source->priorityPending = false;
+            int failed = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if( failed )
+            {
+                source->priorityError.store(failed, std::memory_order_relaxed);
+            }
+        }
+
+        if( statusFlags & paInputOverflow )
+        {
+            stats->overflows.fetch_add(1, std::memory_order_relaxed);
+        }
+        if( statusFlags & paInputUnderflow )
+        {
+            stats->underflows.fetch_add(1, std::memory_order_relaxed);
+        }
+        if( framesPerBuffer < source->blockFrames )
+        {
+            stats->partial.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        //Every channel is queued interleaved, as portaudio delivers it. If the ring
+        //is full the analysis has fallen a whole ring behind and the remainder
+        //of this buffer is dropped, whole frames at a time so the channels
+        //never slip out of step.
+        size_t room = source->samples->writeAvailable() / channels * channels;
+        if( inputBuffer == NULL )
+        {
+            stats->silent.fetch_add(1, std::memory_order_relaxed);
+            written = source->samples->fillSilence(count < room ? count : room);
+        }
+        else
+        {
+            written = source->samples->push(inputBuffer, count < room ? count : room);
+        }
+        if( written < count )
+        {
+            stats->truncated.fetch_add(1, std::memory_order_relaxed);
+            stats->dropped.fetch_add(count - written, std::memory_order_relaxed);
+        }
+        source->stamp(adcTime, adcNs, written / channels);
+        int64_t finished = monotonicNow();
+        source->delivered(finished - started, finished);
+        return paContinue;
+    }
+
+    //Consumer side timing state
+    uint64_t sequence;
+    BlockTime lastTime;        //latest block at or before the frames analysed so far
+    BlockTime pendingTime;     //popped but not reached yet, if havePending
+    bool havePending;
+    bool publishedDark;        //the last frame published was all zero
+    int64_t lastPublishNs;
+    int64_t keepaliveNs;       //between frames while dark, 0 for none
+
+    PaStream *stream;
+    SpscRing<BlockTime> blockTimes;
+    uint64_t producedFrames;   //producer only
+    void *block;               //blocking reads that would straddle the ring's wrap, or generated audio
+    unsigned long blockFrames;
+    int callbackPriority;      //SCHED_FIFO priority of an ALSA callback thread, 0 for portaudio's choice
+    bool priorityPending;      //the next callback applies it to its thread, set before the stream starts
+    std::atomic<int> priorityError;    //errno from applying it, reported by checkWatchdog
+    std::atomic<bool> capturing;
+    std::thread captureThread;
+    int64_t reportStart;
+    CaptureTotals reported;    //totals at the last report
+
+    //File and generator replay
+    AudioFile file;
+    SignalGenerator generator;
+    bool fromFile;
+    bool fromSynth;
+    bool filePaced;
+    bool fileLoop;
+    std::atomic<bool> finished;        //the replay thread reached the end
+    bool sampleClocked;                //publish by frames analysed, not the wall clock
+    uint64_t publishFrames;            //frames between publishes when sampleClocked
+    uint64_t nextPublish;
+};
+
+#endif
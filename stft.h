@@ -0,0 +1,96 @@
+#ifndef STFT_H
+#define STFT_H
+
+#include <stdlib.h>
+#include <math.h>
+
+//Streaming short-time Fourier transform front end.
+//Frames of frameSize samples overlap and a new one starts every hop samples.
+//Each channel's sample history is stored twice over in a planar buffer of
+//2*frameSize, so the latest frame is always one contiguous run and nothing is
+//shifted or copied as it slides; the only pass over a frame is applying the
+//window into the FFT input.
+
+enum WindowType
+{
+    WINDOW_RECTANGULAR = 0,
+    WINDOW_HANN = 1,
+    WINDOW_HAMMING = 2,
+    WINDOW_BLACKMAN = 3
+};
+
+class Stft
+{
+public:
+    Stft() : frameSize(0), hop(0), channels(0), window(NULL), history(NULL), writePos(0) {}
+    ~Stft() {
+        free(window);
+        free(history);
+    }
+
+    bool init(int size, int hopSize, int channelCount, WindowType type) {
+        frameSize = size;
+        hop = hopSize;
+        channels = channelCount;
+        writePos = 0;
+        free(window);
+        free(history);
+        window = (double *) malloc(frameSize * sizeof(double));
+        history = (double *) calloc(2 * frameSize * channels, sizeof(double));
+        if(window == NULL || history == NULL) {
+            return false;
+        }
+        for(int i=0; i<frameSize; i++) {
+            double phase = 2 * M_PI * i / (frameSize - 1);
+            switch(type) {
+                case WINDOW_HANN:     window[i] = 0.5 - 0.5 * cos(phase); break;
+                case WINDOW_HAMMING:  window[i] = 0.54 - 0.46 * cos(phase); break;
+                case WINDOW_BLACKMAN: window[i] = 0.42 - 0.5 * cos(phase) + 0.08 * cos(2 * phase); break;
+                default:              window[i] = 1; break;
+            }
+        }
+        return true;
+    }
+
+    //Append n interleaved frames (normally one hop) to the planar histories
+    template <typename T>
+    void push(const T *samples, int n) {
+        for(int c=0; c<channels; c++) {
+            double *channel = history + 2 * frameSize * c;
+            int pos = writePos;
+            for(int i=0; i<n; i++) {
+                channel[pos] = channel[pos + frameSize] = samples[i * channels + c];
+                if(++pos == frameSize) {
+                    pos = 0;
+                }
+            }
+        }
+        writePos = (writePos + n) % frameSize;
+    }
+
+    //Write each channel's latest frameSize samples, windowed, into out,
+    //channel c starting at out + c*frameSize
+    void frame(double *out) const {
+        for(int c=0; c<channels; c++) {
+            const double *latest = history + 2 * frameSize * c + writePos;
+            double *channel = out + frameSize * c;
+            for(int i=0; i<frameSize; i++) {
+                channel[i] = latest[i] * window[i];
+            }
+        }
+    }
+
+    int frameSize;
+    int hop;
+    int channels;
+
+private:
+    Stft(const Stft &);
+    Stft &operator=(const Stft &);
+
+    double *window;
+    double *history;
+    int writePos;      //oldest sample of the latest frame
+};
+
+#endif
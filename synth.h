@@ -0,0 +1,276 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "sample.h"
+
+//Generated test signals, so the whole pipeline can be run and measured
+//without audio hardware. "synth:<signal>" names one as a device:
+//
+//  synth:sine:<hz>                  one sine, 1000 Hz if left out
+//  synth:tones:<hz>,<hz>,...        up to SYNTH_MAX_TONES sines summed
+//  synth:sweep:<from>-<to>:<s>      logarithmic sweep, repeated every s seconds,
+//                                   20 Hz to just below Nyquist over 10 s if left out
+//  synth:white / synth:pink         noise, independent on each channel
+//  synth:impulse:<hz>               single sample clicks, hz times a second
+//
+//Tones, sweeps and impulses are the same on every channel. The level is the
+//peak of the whole signal, so tones share it and never clip.
+
+#define SYNTH_DEVICE_PREFIX "synth:"
+#define SYNTH_MAX_TONES (16)
+
+enum SynthKind
+{
+    SYNTH_TONES,
+    SYNTH_SWEEP,
+    SYNTH_WHITE,
+    SYNTH_PINK,
+    SYNTH_IMPULSE
+};
+
+inline bool synthIsDevice(const char *device) {
+    return strncmp(device, SYNTH_DEVICE_PREFIX, strlen(SYNTH_DEVICE_PREFIX)) == 0;
+}
+
+class SignalGenerator
+{
+public:
+    SignalGenerator() : kind(SYNTH_TONES), channels(0), sampleRate(0), level(0), tones(0), sweepFrom(0), sweepStep(1),
+        sweepFrames(0), sweepFrequency(0), sweepPhase(0), impulsePeriod(0), impulseNext(0), position(0), noise(NULL),
+        scratch(NULL), scratchFrames(0) {
+        description[0] = '\0';
+    }
+    ~SignalGenerator() {
+        free(noise);
+        free(scratch);
+    }
+
+    //Parse spec, the device name after "synth:", for rate and channelCount.
+    //levelDb is the peak in dB below full scale. render() takes at most
+    //maxFrames at a time. Prints what went wrong on failure.
+    bool init(const char *spec, double rate, int channelCount, double levelDb, size_t maxFrames) {
+        channels = channelCount;
+        sampleRate = rate;
+        level = pow(10, levelDb / 20);
+        position = 0;
+        tones = 0;
+        char name[32];
+        const char *args = strchr(spec, ':');
+        snprintf(name, sizeof(name), "%.*s", (int) (args != NULL ? args - spec : strlen(spec)), spec);
+        args = args != NULL ? args + 1 : "";
+
+        bool ok = true;
+        if(strcmp(name, "sine") == 0 || strcmp(name, "tones") == 0) {
+            kind = SYNTH_TONES;
+            ok = parseTones(*args ? args : "1000");
+        } else if(strcmp(name, "sweep") == 0) {
+            kind = SYNTH_SWEEP;
+            double from = 20, to = rate * 0.45, seconds = 10;
+            if(*args && sscanf(args, "%lf-%lf:%lf", &from, &to, &seconds) != 3) {
+                fprintf(stderr, "Invalid sweep '%s', expected <from>-<to>:<seconds>\n", args);
+                return false;
+            }
+            if(seconds * rate < 1) {
+                fprintf(stderr, "Invalid sweep '%s', it must last at least one sample\n", args);
+                return false;
+            }
+            ok = checkFrequency(from) && checkFrequency(to);
+            sweepFrom = from;
+            sweepFrames = (uint64_t) (seconds * rate);
+            sweepStep = pow(to / from, 1.0 / sweepFrames);
+            sweepFrequency = from;
+            sweepPhase = 0;
+            snprintf(description, sizeof(description), "%.0f-%.0f Hz sweep every %.1f s", from, to, seconds);
+        } else if(strcmp(name, "white") == 0 || strcmp(name, "pink") == 0) {
+            kind = name[0] == 'w' ? SYNTH_WHITE : SYNTH_PINK;
+            free(noise);
+            noise = (SynthNoise *) calloc(channels, sizeof(SynthNoise));
+            if(noise == NULL) {
+                return false;
+            }
+            for(int c=0; c<channels; c++) {
+                noise[c].seed = 0x9E3779B9u * (c + 1);
+            }
+            snprintf(description, sizeof(description), "%s noise", name);
+        } else if(strcmp(name, "impulse") == 0) {
+            kind = SYNTH_IMPULSE;
+            double rateHz = *args ? atof(args) : 1;
+            ok = rateHz > 0 && rateHz <= rate;
+            impulsePeriod = ok ? rate / rateHz : 0;
+            impulseNext = 0;
+            snprintf(description, sizeof(description), "impulses at %g Hz", rateHz);
+        } else {
+            fprintf(stderr, "Unknown signal '%s', expected sine, tones, sweep, white, pink or impulse\n", name);
+            return false;
+        }
+        if(!ok) {
+            fprintf(stderr, "Invalid signal '%s' for %.0f Hz\n", spec, rate);
+            return false;
+        }
+        free(scratch);
+        scratchFrames = maxFrames;
+        scratch = (float *) malloc(maxFrames * channels * sizeof(float));
+        return scratch != NULL;
+    }
+
+    //Generate the next frames, interleaved, in format
+    void render(SampleFormat format, void *dst, size_t frames) {
+        if(frames > scratchFrames) {
+            frames = scratchFrames;
+        }
+        for(size_t i=0; i<frames; i++) {
+            float *frame = scratch + i * channels;
+            if(kind == SYNTH_WHITE || kind == SYNTH_PINK) {
+                for(int c=0; c<channels; c++) {
+                    frame[c] = kind == SYNTH_WHITE ? level * white(&noise[c]) : level * pink(&noise[c]);
+                }
+            } else {
+                float value = next();
+                for(int c=0; c<channels; c++) {
+                    frame[c] = value;
+                }
+            }
+            position++;
+        }
+        //Keep the tone oscillators on the unit circle, rounding drifts them slowly
+        for(int t=0; t<tones; t++) {
+            double norm = 1 / sqrt(toneRe[t] * toneRe[t] + toneIm[t] * toneIm[t]);
+            toneRe[t] *= norm;
+            toneIm[t] *= norm;
+        }
+        sampleFromUnit(format, scratch, dst, frames * channels);
+    }
+
+    char description[128];
+
+private:
+    SignalGenerator(const SignalGenerator &);
+    SignalGenerator &operator=(const SignalGenerator &);
+
+    typedef struct
+    {
+        uint32_t seed;
+        float b[7];            //pink filter state
+    }
+    SynthNoise;
+
+    bool checkFrequency(double hz) const {
+        return hz > 0 && hz < sampleRate / 2;
+    }
+
+    bool parseTones(const char *list) {
+        tones = 0;
+        char text[256];
+        snprintf(text, sizeof(text), "%s", list);
+        int written = snprintf(description, sizeof(description), "%s", "");
+        char *saved = NULL;
+        for(char *part = strtok_r(text, ",", &saved); part != NULL; part = strtok_r(NULL, ",", &saved)) {
+            double hz = atof(part);
+            if(tones == SYNTH_MAX_TONES || !checkFrequency(hz)) {
+                return false;
+            }
+            //Each tone is a phasor turned a fixed angle per sample, cheaper than sin()
+            toneRe[tones] = 1;
+            toneIm[tones] = 0;
+            toneStepRe[tones] = cos(2 * M_PI * hz / sampleRate);
+            toneStepIm[tones] = sin(2 * M_PI * hz / sampleRate);
+            tones++;
+            if(written < (int) sizeof(description)) {
+                written += snprintf(description + written, sizeof(description) - written, "%s%g", tones > 1 ? "+" : "", hz);
+            }
+        }
+        if(written < (int) sizeof(description)) {
+            snprintf(description + written, sizeof(description) - written, " Hz %s", tones > 1 ? "tones" : "sine");
+        }
+        return tones > 0;
+    }
+
+    //Next sample of the signals that are the same on every channel
+    float next() {
+        double value = 0;
+        switch(kind) {
+            case SYNTH_TONES:
+                for(int t=0; t<tones; t++) {
+                    double re = toneRe[t] * toneStepRe[t] - toneIm[t] * toneStepIm[t];
+                    toneIm[t] = toneRe[t] * toneStepIm[t] + toneIm[t] * toneStepRe[t];
+                    toneRe[t] = re;
+                    value += toneIm[t];
+                }
+                return (float) (level * value / tones);
+            case SYNTH_SWEEP:
+                value = sin(sweepPhase);
+                sweepPhase += 2 * M_PI * sweepFrequency / sampleRate;
+                if(sweepPhase > 2 * M_PI) {
+                    sweepPhase -= 2 * M_PI;
+                }
+                sweepFrequency *= sweepStep;
+                if((position + 1) % sweepFrames == 0) {
+                    sweepFrequency = sweepFrom;
+                }
+                return (float) (level * value);
+            case SYNTH_IMPULSE:
+                if((double) position >= impulseNext) {
+                    impulseNext += impulsePeriod;
+                    value = level;
+                }
+                return (float) value;
+            default:
+                return 0;
+        }
+    }
+
+    //xorshift32, uniform in -1..1
+    static float white(SynthNoise *state) {
+        uint32_t x = state->seed;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        state->seed = x;
+        return (float) ((int32_t) x * (1.0 / 2147483648.0));
+    }
+
+    //Paul Kellett's filter, -3 dB per octave from white within 0.05 dB
+    static float pink(SynthNoise *state) {
+        float w = white(state);
+        float *b = state->b;
+        b[0] = 0.99886f * b[0] + w * 0.0555179f;
+        b[1] = 0.99332f * b[1] + w * 0.0750759f;
+        b[2] = 0.96900f * b[2] + w * 0.1538520f;
+        b[3] = 0.86650f * b[3] + w * 0.3104856f;
+        b[4] = 0.55000f * b[4] + w * 0.5329522f;
+        b[5] = -0.7616f * b[5] - w * 0.0168980f;
+        float value = b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] + w * 0.5362f;
+        b[6] = w * 0.115926f;
+        value *= 0.11f;
+        return value < -1 ? -1 : value > 1 ? 1 : value;
+    }
+
+    SynthKind kind;
+    int channels;
+    double sampleRate;
+    double level;              //peak, 0-1
+    int tones;
+    double toneRe[SYNTH_MAX_TONES];
+    double toneIm[SYNTH_MAX_TONES];
+    double toneStepRe[SYNTH_MAX_TONES];
+    double toneStepIm[SYNTH_MAX_TONES];
+    double sweepFrom;
+    double sweepStep;          //frequency ratio from one sample to the next
+    uint64_t sweepFrames;
+    double sweepFrequency;
+    double sweepPhase;
+    double impulsePeriod;      //samples between impulses
+    double impulseNext;
+    uint64_t position;         //frames generated
+    SynthNoise *noise;         //per channel
+    float *scratch;
+    size_t scratchFrames;
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+//Serialisation of a spectrum into a message body.
+//Binary frames start with an 8 byte header, all fields little-endian:
+//  0  'M' 'L'        magic
+//  2  uint8          WIRE_VERSION
+//  3  uint8          WireFormat of the payload
+//  4  uint16         bins per channel
+//  6  uint16         channels
+//followed by channels*bins values, either float32 in 0-1 or uint8 in 0-255.
+//The text format is the original comma separated list of floats.
+
+#define WIRE_VERSION (1)
+#define WIRE_HEADER_SIZE (8)
+//Widest text value is "%f" of 1.0 plus a comma
+#define WIRE_TEXT_BIN_SIZE (16)
+
+enum WireFormat
+{
+    WIRE_TEXT = 0,
+    WIRE_FLOAT32 = 1,
+    WIRE_UINT8 = 2
+};
+
+inline const char *wireContentType(WireFormat format) {
+    switch(format) {
+        case WIRE_FLOAT32: return "application/x-music-loop-f32";
+        case WIRE_UINT8:   return "application/x-music-loop-u8";
+        default:           return "text/plain";
+    }
+}
+
+//Message body reused for every frame so publishing never touches the heap
+typedef struct
+{
+    unsigned char *data;
+    size_t capacity;
+    size_t length;
+}
+WireBuffer;
+
+//Largest body any format can produce for the given shape
+inline size_t wireMaxSize(int bins, int channels) {
+    return WIRE_HEADER_SIZE + (size_t) bins * channels * WIRE_TEXT_BIN_SIZE;
+}
+
+inline bool wireBufferInit(WireBuffer *buffer, int bins, int channels) {
+    buffer->capacity = wireMaxSize(bins, channels);
+    buffer->length = 0;
+    buffer->data = (unsigned char *) malloc(buffer->capacity);
+    return buffer->data != NULL;
+}
+
+inline void wireBufferFree(WireBuffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    buffer->length = 0;
+}
+
+inline unsigned char *wirePutU16(unsigned char *out, uint16_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+inline unsigned char *wirePutF32(unsigned char *out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    out[0] = bits & 0xff;
+    out[1] = (bits >> 8) & 0xff;
+    out[2] = (bits >> 16) & 0xff;
+    out[3] = bits >> 24;
+    return out + 4;
+}
+
+//Encode channels*bins values (channel after channel) into buffer.
+//Returns false if the buffer is too small, which means it was sized for a different shape.
+inline bool wireEncode(WireBuffer *buffer, WireFormat format, const double *values, int bins, int channels) {
+    int count = bins * channels;
+    if(wireMaxSize(bins, channels) > buffer->capacity) {
+        return false;
+    }
+
+    if(format == WIRE_TEXT) {
+        char *out = (char *) buffer->data;
+        char *end = out + buffer->capacity;
+        for(int i=0; i<count; i++) {
+            out += snprintf(out, end - out, i < count - 1 ? "%f," : "%f", values[i]);
+        }
+        buffer->length = out - (char *) buffer->data;
+        return true;
+    }
+
+    unsigned char *out = buffer->data;
+    *out++ = 'M';
+    *out++ = 'L';
+    *out++ = WIRE_VERSION;
+    *out++ = (unsigned char) format;
+    out = wirePutU16(out, bins);
+    out = wirePutU16(out, channels);
+    if(format == WIRE_FLOAT32) {
+        for(int i=0; i<count; i++) {
+            out = wirePutF32(out, (float) values[i]);
+        }
+    } else {
+        for(int i=0; i<count; i++) {
+            double v = values[i] < 0 ? 0 : (values[i] > 1 ? 1 : values[i]);
+            *out++ = (unsigned char) (v * 255 + 0.5);
+        }
+    }
+    buffer->length = out - buffer->data;
+    return true;
+}
+
+#endif
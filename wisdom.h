@@ -0,0 +1,62 @@
+#ifndef WISDOM_H
+#define WISDOM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fftw3.h>
+
+//FFTW wisdom persisted between runs so FFTW_MEASURE only benchmarks once per host.
+//Wisdom is only valid for the machine that measured it, so the file name
+//carries the transform (precision, type, size) and a hash of the CPU model.
+
+#define WISDOM_PRECISION "d"
+
+//Hash of the "model name" line of /proc/cpuinfo, or 0 if it is unreadable
+inline uint32_t wisdomCpuKey() {
+    uint32_t hash = 2166136261u;
+    char line[256];
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if(cpuinfo == NULL) {
+        return 0;
+    }
+    while(fgets(line, sizeof(line), cpuinfo) != NULL) {
+        if(strncmp(line, "model name", 10) == 0) {
+            for(char *c = line; *c; c++) {
+                hash = (hash ^ (unsigned char) *c) * 16777619u;
+            }
+            break;
+        }
+    }
+    fclose(cpuinfo);
+    return hash;
+}
+
+//Build the wisdom file path for a transform, e.g.
+//<dir>/music-loop-d-r2c-400-cpu-1a2b3c4d.wisdom
+inline void wisdomFileName(char *path, size_t len, const char *dir, const char *type, int size) {
+    snprintf(path, len, "%s/music-loop-%s-%s-%d-cpu-%08x.wisdom",
+        dir, WISDOM_PRECISION, type, size, (unsigned) wisdomCpuKey());
+}
+
+//Missing or stale wisdom is not an error, planning just takes longer
+inline bool wisdomImport(const char *path) {
+    if(path == NULL) {
+        return false;
+    }
+    return fftw_import_wisdom_from_filename(path) != 0;
+}
+
+inline bool wisdomExport(const char *path) {
+    if(path == NULL) {
+        return false;
+    }
+    if(!fftw_export_wisdom_to_filename(path)) {
+        fprintf(stderr, "Could not write fft wisdom to %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+#endif